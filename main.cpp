@@ -1,18 +1,47 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
 #include <random>
+#include <thread>
+#include <tuple>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) &&         \
+    !defined(KMEANS_DISABLE_SIMD)
+#define KMEANS_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "lib/stb_image.h"
 
 #define IMAGE_CHANNELS 3
 #define DATASETS_RESERVE 100
 #define DEFAULT_REPEATITION 20
+#define PIXEL_ALIGNMENT 64
+#define DECODE_BLOCK (1 << 20)
 
 using duration = std::chrono::duration<float>;
 namespace fs = std::filesystem;
@@ -40,6 +69,265 @@ constexpr const char *output_type_to_string(const KMeansOutputType type) {
   }
 }
 
+enum class KMeansAlgorithm : uint8_t { Lloyd, Elkan, Hamerly, Yinyang };
+
+constexpr const char *algorithm_to_string(const KMeansAlgorithm algorithm) {
+  switch (algorithm) {
+  case KMeansAlgorithm::Elkan:
+    return "elkan";
+  case KMeansAlgorithm::Hamerly:
+    return "hamerly";
+  case KMeansAlgorithm::Yinyang:
+    return "yinyang";
+  default:
+    return "lloyd";
+  }
+}
+
+KMeansAlgorithm algorithm_from_string(const std::string &name) {
+  for (const auto algorithm : {KMeansAlgorithm::Lloyd, KMeansAlgorithm::Elkan,
+                               KMeansAlgorithm::Hamerly,
+                               KMeansAlgorithm::Yinyang}) {
+    if (name == algorithm_to_string(algorithm)) {
+      return algorithm;
+    }
+  }
+
+  throw std::domain_error("unknown algorithm: '" + name + "'");
+}
+
+enum class KMeansInit : uint8_t { Random, PlusPlus, Parallel };
+
+constexpr const char *init_to_string(const KMeansInit init) {
+  switch (init) {
+  case KMeansInit::PlusPlus:
+    return "kmeans++";
+  case KMeansInit::Parallel:
+    return "kmeans||";
+  default:
+    return "random";
+  }
+}
+
+KMeansInit init_from_string(const std::string &name) {
+  for (const auto init :
+       {KMeansInit::Random, KMeansInit::PlusPlus, KMeansInit::Parallel}) {
+    if (name == init_to_string(init)) {
+      return init;
+    }
+  }
+
+  throw std::domain_error("unknown init: '" + name + "'");
+}
+
+enum class KMeansMetric : uint8_t { Euclidean, Manhattan, Chebyshev };
+
+constexpr const char *metric_to_string(const KMeansMetric metric) {
+  switch (metric) {
+  case KMeansMetric::Manhattan:
+    return "manhattan";
+  case KMeansMetric::Chebyshev:
+    return "chebyshev";
+  default:
+    return "euclidean";
+  }
+}
+
+KMeansMetric metric_from_string(const std::string &name) {
+  for (const auto metric : {KMeansMetric::Euclidean, KMeansMetric::Manhattan,
+                            KMeansMetric::Chebyshev}) {
+    if (name == metric_to_string(metric)) {
+      return metric;
+    }
+  }
+
+  throw std::domain_error("unknown metric: '" + name + "'");
+}
+
+enum class KMeansPrecision : uint8_t { Int32, Float32, Float64 };
+
+constexpr const char *precision_to_string(const KMeansPrecision precision) {
+  switch (precision) {
+  case KMeansPrecision::Float32:
+    return "float32";
+  case KMeansPrecision::Float64:
+    return "float64";
+  default:
+    return "int32";
+  }
+}
+
+KMeansPrecision precision_from_string(const std::string &name) {
+  for (const auto precision :
+       {KMeansPrecision::Int32, KMeansPrecision::Float32,
+        KMeansPrecision::Float64}) {
+    if (name == precision_to_string(precision)) {
+      return precision;
+    }
+  }
+
+  throw std::domain_error("unknown precision: '" + name + "'");
+}
+
+struct KMeansOptions {
+  KMeansAlgorithm algorithm = KMeansAlgorithm::Lloyd;
+  KMeansInit init = KMeansInit::Random;
+  KMeansMetric metric = KMeansMetric::Euclidean;
+  // Distances of the Lloyd assignment kernels; the bounded algorithms always
+  // compare double distances. float64 is exact for the double means, float32
+  // rounds them to float and int32 to the nearest integer.
+  KMeansPrecision precision = KMeansPrecision::Float64;
+  uint32_t max_iterations = 1000;
+  // Threads used by the Lloyd iterations; 0 means one per hardware thread.
+  uint32_t threads = 1;
+  // Repetitions exp() runs concurrently, one per worker; 0 means one per
+  // hardware thread.
+  uint32_t jobs = 1;
+  // Coarser levels (each half the width and height of the next) the means
+  // converge on before full resolution; 0 runs at full resolution only.
+  uint32_t pyramid = 0;
+  // Decoded images exp() keeps ready ahead of the one being clustered; 0
+  // decodes each image on the calling thread when it is needed.
+  uint32_t prefetch = 1;
+  // Directory of the decoded pixel cache; empty decodes every image.
+  fs::path cache;
+  // Directory of the label files of streamed runs; empty loads every image.
+  fs::path stream;
+  // Pixels per tile of a streamed run.
+  size_t tile = 1 << 20;
+  // Seed of the initialization; 0 draws one from std::random_device.
+  uint64_t seed = 0;
+  // Iterate over the unique colors weighted by their pixel count.
+  bool histogram = false;
+  // Pixels per iteration of mini-batch k-means; 0 runs full iterations.
+  size_t mini_batch = 0;
+  // Mini-batch runs stop once no mean moves farther than this in an
+  // iteration.
+  double tolerance = 0.1;
+  // Label every pixel after the last mini-batch.
+  bool final_pass = true;
+  // One OnlineKMeans pass in chunks of `tile` pixels, without labels.
+  bool online = false;
+};
+
+// Persistent pool of worker threads. run() calls job(t) for every t in
+// [0, size()), with the calling thread taking t = 0, and returns once all of
+// them have finished. The job is passed to the workers by address, so
+// dispatching one never allocates. An exception thrown by a job is kept
+// until every job has finished, then rethrown by run().
+class ThreadPool {
+public:
+  explicit ThreadPool(const uint32_t threads) : errors(threads) {
+    workers.reserve(threads - 1);
+    for (uint32_t t = 1; t < threads; ++t) {
+      workers.emplace_back(&ThreadPool::work, this, t);
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    start.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  inline uint32_t size() const { return workers.size() + 1; }
+
+  template <typename Job> void run(const Job &job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      current = &job;
+      invoke = [](const void *job, const uint32_t t) {
+        (*static_cast<const Job *>(job))(t);
+      };
+      pending = workers.size();
+      ++generation;
+    }
+    start.notify_all();
+
+    try {
+      job(0);
+    } catch (...) {
+      errors[0] = std::current_exception();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return pending == 0; });
+    current = nullptr;
+    lock.unlock();
+
+    std::exception_ptr first;
+    for (auto &error : errors) {
+      if (!first) {
+        first = error;
+      }
+      error = nullptr;
+    }
+    if (first) {
+      std::rethrow_exception(first);
+    }
+  }
+
+private:
+  std::vector<std::thread> workers;
+  // Exception of every job of the last run, by t.
+  std::vector<std::exception_ptr> errors;
+  std::mutex mutex;
+  std::condition_variable start, done;
+  const void *current = nullptr;
+  void (*invoke)(const void *job, uint32_t t) = nullptr;
+  uint64_t generation = 0;
+  size_t pending = 0;
+  bool stopping = false;
+
+  void work(const uint32_t index) {
+    uint64_t seen = 0;
+    while (true) {
+      const void *job;
+      void (*call)(const void *, uint32_t);
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        start.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping) {
+          return;
+        }
+        seen = generation;
+        job = current;
+        call = invoke;
+      }
+
+      try {
+        call(job, index);
+      } catch (...) {
+        errors[index] = std::current_exception();
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--pending == 0) {
+        done.notify_one();
+      }
+    }
+  }
+};
+
+// Process-wide pool, rebuilt only when a different thread count is asked for.
+ThreadPool &thread_pool(const uint32_t threads) {
+  static std::unique_ptr<ThreadPool> pool;
+  if (!pool || pool->size() != threads) {
+    pool.reset();
+    pool = std::make_unique<ThreadPool>(threads);
+  }
+  return *pool;
+}
+
+uint32_t resolve_threads(const uint32_t threads) {
+  return threads ? threads : std::max(std::thread::hardware_concurrency(), 1u);
+}
+
 struct Dataset {
   const fs::path image;
   const uint16_t repeat;
@@ -54,15 +342,149 @@ struct Pixel {
   int32_t r, g, b;
 };
 
-struct PixelCoord : Pixel {
-  uint32_t x, y;
+// Centroid of a cluster, kept at full precision: the exact mean of its
+// pixels. A pixel converts to the mean of itself.
+struct Mean {
+  double r, g, b;
+
+  Mean() = default;
+  Mean(const double _r, const double _g, const double _b)
+      : r(_r), g(_g), b(_b) {}
+  Mean(const Pixel &pixel) : r(pixel.r), g(pixel.g), b(pixel.b) {}
+};
+
+struct AlignedFree {
+  void operator()(void *ptr) const { std::free(ptr); }
+};
+
+template <typename T> using AlignedArray = std::unique_ptr<T[], AlignedFree>;
+
+// Allocates n elements on a PIXEL_ALIGNMENT boundary, rounded up to a whole
+// number of aligned blocks so vector loads never cross the allocation.
+template <typename T> AlignedArray<T> make_aligned_array(const size_t n) {
+  const size_t bytes = std::max<size_t>(
+      (n * sizeof(T) + PIXEL_ALIGNMENT - 1) / PIXEL_ALIGNMENT * PIXEL_ALIGNMENT,
+      PIXEL_ALIGNMENT);
+  void *const ptr = std::aligned_alloc(PIXEL_ALIGNMENT, bytes);
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+
+  return AlignedArray<T>(static_cast<T *>(ptr));
+}
+
+struct ColorHistogram;
+
+// Planar (structure of arrays) pixel store: one 8-bit plane per channel, in
+// row-major order, each on a PIXEL_ALIGNMENT boundary and padded to
+// plane_bytes(). The three planes are consecutive in `storage`, either an
+// aligned allocation or a mapped pixel cache file. Coordinates are implied by
+// the index.
+struct PixelPlanes {
+  const uint32_t width, height;
+  const size_t size;
+  const std::shared_ptr<uint8_t[]> storage;
+  uint8_t *const r, *const g, *const b;
+
+  PixelPlanes(const uint32_t _width, const uint32_t _height)
+      : PixelPlanes(_width, _height,
+                    make_aligned_array<uint8_t>(
+                        IMAGE_CHANNELS *
+                        plane_bytes(static_cast<size_t>(_width) * _height))) {}
+  PixelPlanes(const uint32_t _width, const uint32_t _height,
+              std::shared_ptr<uint8_t[]> _storage)
+      : width(_width), height(_height),
+        size(static_cast<size_t>(_width) * _height),
+        storage(std::move(_storage)), r(storage.get()),
+        g(r + plane_bytes(size)), b(g + plane_bytes(size)) {}
+  ~PixelPlanes();
+
+  inline Pixel operator[](const size_t i) const { return {r[i], g[i], b[i]}; }
+  inline const uint8_t *plane(const uint32_t c) const {
+    return c == 0 ? r : c == 1 ? g : b;
+  }
+
+  // Bytes of one plane: size rounded up to whole aligned blocks, so vector
+  // loads never cross into the next plane.
+  static inline size_t plane_bytes(const size_t size) {
+    return std::max<size_t>((size + PIXEL_ALIGNMENT - 1) / PIXEL_ALIGNMENT *
+                                PIXEL_ALIGNMENT,
+                            PIXEL_ALIGNMENT);
+  }
+
+  // Unique colors of the pixels, built on first use (thread-safe) and shared
+  // by every run over this dataset.
+  const ColorHistogram &histogram() const;
+
+  // Half the width and height, each pixel the rounded mean of a 2x2 block
+  // (an odd last row or column is dropped). Built on first use like the
+  // histogram; needs width and height of at least 2.
+  const PixelPlanes &half() const;
+
+private:
+  mutable std::once_flag histogram_once, half_once;
+  mutable std::unique_ptr<ColorHistogram> histogram_ptr;
+  mutable std::unique_ptr<PixelPlanes> half_ptr;
+};
+
+// Labels are stored as narrow as K allows: uint8 up to 255 clusters, uint16
+// up to 65535 and uint32 beyond. The largest value of the type is never a
+// class, so it marks labels not assigned yet. A run uses the vector of its
+// width.
+using LabelStorage = std::tuple<std::vector<uint8_t>, std::vector<uint16_t>,
+                                std::vector<uint32_t>>;
+
+// Read-only view over the labels of one width.
+class LabelView {
+public:
+  template <typename Label>
+  explicit LabelView(const std::vector<Label> &labels)
+      : LabelView(labels.data(), labels.size()) {}
+  template <typename Label>
+  LabelView(const Label *_labels, const size_t _count)
+      : labels(_labels), count(_count), bytes(sizeof(Label)) {}
+
+  inline size_t operator[](const size_t i) const {
+    switch (bytes) {
+    case 1:
+      return static_cast<const uint8_t *>(labels)[i];
+    case 2:
+      return static_cast<const uint16_t *>(labels)[i];
+    default:
+      return static_cast<const uint32_t *>(labels)[i];
+    }
+  }
+
+  inline size_t size() const { return count; }
+  inline uint8_t width() const { return bytes; }
+
+private:
+  const void *labels;
+  size_t count;
+  uint8_t bytes;
+};
+
+// A coarser level of a --pyramid run, converged before the next finer one.
+struct PyramidLevel {
+  uint32_t width, height, iterations_count;
+  duration seconds;
 };
 
 struct KMeansResult {
   const duration init_in_seconds, iterations_in_seconds;
   const uint32_t iterations_count, max_iterations;
-  const std::unique_ptr<std::vector<Pixel>> means_ptr;
-  const std::unique_ptr<std::vector<size_t>> classes_ptr;
+  // Means, labels and levels live in the KMeansWorkspace of the run and stay
+  // valid until its next run; owner keeps the workspace of kmeans() alive.
+  const std::vector<Mean> *const means_ptr;
+  const LabelView labels;
+  // Coarser levels of a --pyramid run, coarsest first. Their time is part of
+  // init_in_seconds, the iterations are those at full resolution.
+  const std::vector<PyramidLevel> *const levels_ptr;
+  // Classes changed by every assignment pass of the run; empty for
+  // mini-batch and online runs. A run whose update step repeats the means of
+  // the last pass stops without the pass that would change no class.
+  const std::vector<size_t> *const changes_ptr;
+  std::shared_ptr<const void> owner;
 
   constexpr duration iteration() const {
     return iterations_in_seconds / static_cast<long double>(iterations_count);
@@ -89,8 +511,12 @@ struct KMeansResult {
     }
   }
 
-  inline const std::vector<Pixel> &means() const { return *means_ptr; }
-  inline const std::vector<size_t> &classes() const { return *classes_ptr; }
+  inline const std::vector<Mean> &means() const { return *means_ptr; }
+  inline LabelView classes() const { return labels; }
+  inline const std::vector<PyramidLevel> &levels() const {
+    return *levels_ptr;
+  }
+  inline const std::vector<size_t> &changes() const { return *changes_ptr; }
 };
 
 struct KMeansResultMean {
@@ -123,220 +549,3167 @@ public:
   }
 };
 
-inline long double d(const Pixel &p, const Pixel &q) {
-  const auto r = static_cast<long double>(p.r) - q.r; // (2, 1, 0)
-  const auto g = static_cast<long double>(p.g) - q.g; // (2, 1, 0)
-  const auto b = static_cast<long double>(p.b) - q.b; // (2, 1, 0)
+template <typename Point>
+inline auto channel(const Point &p, const uint32_t c) {
+  return c == 0 ? p.r : c == 1 ? p.g : p.b;
+}
 
-  return std::sqrt(r * r + g * g + b * b);
-  // 3* (2, 1, 0) + (5, 5, 0) + (2, 1, 0) = (13, 9, 0)
+// A channel as the distances of Value see it. Float and double keep the
+// means exact; the int32 distances round them to the nearest integer (means
+// are never negative, so truncating value + 0.5 rounds).
+template <typename Value> inline Value as_value(const int32_t value) {
+  return static_cast<Value>(value);
 }
 
-// ANALISE QUANTITATIVA DA FUNÇÃO kmeans
-// (4, 0, 1) + K * (4, 1, 1) +
-// (3, 0, 1) + N * ((2, 1, 2)) +
-// (5, 0, 0) + K * ((1, 0, 0)) +
-// (0, 0, 1) + X * (
-//    (2, 2, 2) + (
-//       (1, 0, 1) + N * ((1, 1, 1) + (4, 0, 1) +  (1, 0, 1) + K * (
-//          (1, 1, 1) + (16, 9, 1)
-//      )) +
-//       (1, 0, 1) + K * ((1, 1, 1) + (10, 3, 1) + (1, 0, 1) + N * (
-//          (1, 1, 1) + (7, 4, 1)
-//      ))
-//    )
-// )
-//
-// JUNTA OS TERMOS EM COMUM
-//
-// (12, 0, 3) + K * (5, 1, 1) + N * (2, 1, 2) + X * (
-//    (4, 2, 4) + N * ((6, 1, 3) + K * (17, 10, 2)) +
-//    K * ((12, 4, 3) + N * (8, 5, 2))
-// )
-//
-// (12, 0, 3) + K * (5, 1, 1) + N * (2, 1, 2) + X * (
-//    (4, 2, 4) + N * (6, 1, 3) + (N * K) * (17, 10, 2) +
-//    K * (12, 4, 3) + (N * K) * (8, 5, 2)
-// )
-//
-// (12, 0, 3) + K * (5, 1, 1) + N * (2, 1, 2) + X * (
-//    (4, 2, 4) + N * (6, 1 ,3) + K * (12, 4, 3) + (N * K) * (25, 15, 4)
-// )
-//
-// Separando (A, O, C)
-// A = 12 + 5K + 2N + X (4 + 6N + 12K + 25NK)
-// O = K + N + X (2 + N + 4K + 15NK)
-// C = 3 + K + 2N + X (4 + 3N + 3K + 4NK)
-//
-//  INIT
-// A = 12 + 5K + 2N
-// O = K + N
-// C = 3 + K + 2N
-//
-//  ITERATION
-// A = 4 + 6 + 12K + 25NK
-// O = 2 + N + 4K + 15NK
-// C = 4 + 3N + 3K + 4NK
-//
-// Utilizar a aula 11 (1h01min) para construir a tabela e ter as normas L1 e L2
+template <typename Value> inline Value as_value(const double value) {
+  if constexpr (std::is_integral<Value>::value) {
+    return static_cast<Value>(value + 0.5);
+  } else {
+    return static_cast<Value>(value);
+  }
+}
 
-KMeansResult kmeans(const std::vector<PixelCoord> &dataset, const size_t N,
-                    const uint32_t K, const uint32_t max_iterations = 1000) {
+// Distance metrics of the assignment step, chosen at compile time. distance()
+// is the value the kernels compare, in the Value of the precision policy and
+// between pixels and means alike, so the Euclidean metric compares squared
+// distances and never takes a square root while assigning; bound() maps it
+// back to the metric itself, which is what the triangle inequality of the
+// bounded algorithms needs. The SIMD kernels build the distance from the
+// differences of the channels, squared or absolute (squares) and then summed
+// or maxed (sums); the fixed-K kernels use pair_term(), the folded terms of
+// two channels packed in 16-bit lanes.
+struct SquaredEuclidean {
+  static constexpr bool squares = true;
+  static constexpr bool sums = true;
+
+  template <typename Value = int32_t, typename P, typename Q>
+  static inline Value distance(const P &p, const Q &q) {
+    const Value r = as_value<Value>(p.r) - as_value<Value>(q.r);
+    const Value g = as_value<Value>(p.g) - as_value<Value>(q.g);
+    const Value b = as_value<Value>(p.b) - as_value<Value>(q.b);
+
+    return r * r + g * g + b * b;
+  }
 
-  std::random_device rdev;
-  std::mt19937 eng{rdev()};
-  std::uniform_int_distribution<int> dist(0, N - 1);
+  static inline double bound(const double distance) {
+    return std::sqrt(distance);
+  }
 
-  const auto init_time_start = std::chrono::high_resolution_clock::now();
+#ifdef KMEANS_X86_SIMD
+  __attribute__((target("avx2"))) static inline __m256i
+  pair_term(const __m256i d) {
+    return _mm256_madd_epi16(d, d);
+  }
 
-  auto means_ptr = std::make_unique<std::vector<Pixel>>(K); // (K + 2, 0, 0)
-  auto &means = *means_ptr;                                 // (1, 0, 0)
-  for (uint32_t k = 0; k < K; ++k) {
-    // g12(1, 0, 1); gr2(1, 1, 1); e2(2, 0, 0)
-    means[k] = dataset[dist(eng)];
+  __attribute__((target("avx512f,avx512bw"))) static inline __m512i
+  pair_term(const __m512i d) {
+    return _mm512_madd_epi16(d, d);
   }
+#endif
+};
 
-  auto classes_ptr = std::make_unique<std::vector<size_t>>(
-      N, std::numeric_limits<size_t>::max()); // (2, 0, 1) + N * (2, 1, 2)
-  auto &classes = *classes_ptr;               // (1, 0, 0)
+struct Manhattan {
+  static constexpr bool squares = false;
+  static constexpr bool sums = true;
 
-  long double distance, minimum;            // (2, 0, 0)
-  uint32_t x = 0;                           // (1, 0, 0)
-  bool changed;                             // (1, 0, 0)
-  std::vector<uint32_t> cluster_counter(K); // (K, 0, 0)
-  size_t new_class = 0;                     // (1, 0, 0)
+  template <typename Value = int32_t, typename P, typename Q>
+  static inline Value distance(const P &p, const Q &q) {
+    return std::abs(as_value<Value>(p.r) - as_value<Value>(q.r)) +
+           std::abs(as_value<Value>(p.g) - as_value<Value>(q.g)) +
+           std::abs(as_value<Value>(p.b) - as_value<Value>(q.b));
+  }
 
-  const auto init_time_end = std::chrono::high_resolution_clock::now();
+  static inline double bound(const double distance) { return distance; }
 
-  const auto iterations_time_start = std::chrono::high_resolution_clock::now();
-  for (; x < max_iterations; ++x) {
-    // g13(0, 0, 1); gr3(1, 1, 1);
-    // ex3 = (1, 1, 1) + (gr4 + ex4) + (gr6 + ex6)
-    changed = false; // (1, 0, 0)
+#ifdef KMEANS_X86_SIMD
+  __attribute__((target("avx2"))) static inline __m256i
+  pair_term(const __m256i d) {
+    return _mm256_madd_epi16(_mm256_abs_epi16(d), _mm256_set1_epi16(1));
+  }
 
-    for (size_t i = 0; i < N; ++i) {
-      // g14(1, 0, 1); gr4(1, 1, 1); ex4 = (4, 0, 1) + N * (gr5 + ex5)
-      minimum = std::numeric_limits<long double>::max(); // (1, 0, 0)
-      new_class = classes[i];                            // (1, 0, 0)
+  __attribute__((target("avx512f,avx512bw"))) static inline __m512i
+  pair_term(const __m512i d) {
+    return _mm512_madd_epi16(_mm512_maskz_abs_epi16(0xFFFFFFFF, d),
+                             _mm512_set1_epi16(1));
+  }
+#endif
+};
 
-      for (uint32_t k = 0; k < K; ++k) {
-        // g15(1, 0, 1); gr5(1, 1, 1); ex5 = (16, 9, 1)
-        distance =                   // (1, 0 ,0)
-            d(dataset[i], means[k]); // inline function: (13, 9, 0)
+struct Chebyshev {
+  static constexpr bool squares = false;
+  static constexpr bool sums = false;
 
-        if (distance < minimum) { // (0, 0, 1) + 2*(1, 0, 0) = (2, 0, 1)
-          minimum = distance;     // (1, 0, 0)
-          new_class = k;          // (1, 0, 0)
-        }
-      }
+  template <typename Value = int32_t, typename P, typename Q>
+  static inline Value distance(const P &p, const Q &q) {
+    const Value r = std::abs(as_value<Value>(p.r) - as_value<Value>(q.r));
+    const Value g = std::abs(as_value<Value>(p.g) - as_value<Value>(q.g));
+    const Value b = std::abs(as_value<Value>(p.b) - as_value<Value>(q.b));
 
-      if (new_class != classes[i]) { // (0, 0, 1) + 2 * (1, 0, 0) = (2, 0, 1)
-        changed = true;
-        classes[i] = new_class;
-      }
-    }
+    return std::max({r, g, b});
+  }
 
-    if (!changed) { // (0, 1, 1)
-      break;
-    }
+  static inline double bound(const double distance) { return distance; }
+
+#ifdef KMEANS_X86_SIMD
+  __attribute__((target("avx2"))) static inline __m256i
+  pair_term(const __m256i d) {
+    const __m256i a = _mm256_abs_epi16(d);
+    return _mm256_max_epi32(_mm256_and_si256(a, _mm256_set1_epi32(0xFFFF)),
+                            _mm256_srli_epi32(a, 16));
+  }
+
+  __attribute__((target("avx512f,avx512bw"))) static inline __m512i
+  pair_term(const __m512i d) {
+    const __m512i a = _mm512_maskz_abs_epi16(0xFFFFFFFF, d);
+    return _mm512_maskz_max_epi32(
+        0xFFFF, _mm512_and_si512(a, _mm512_set1_epi32(0xFFFF)),
+        _mm512_maskz_srli_epi32(0xFFFF, a, 16));
+  }
+#endif
+};
+
+// Nearest-centroid assignment of pixels [begin, end): writes the closest mean
+// of every pixel into classes (ties go to the lowest k) and returns whether
+// any class changed.
+template <typename Label>
+using AssignKernel = bool (*)(const PixelPlanes &dataset, const size_t begin,
+                              const size_t end, const Mean *means,
+                              const uint32_t K, Label *classes);
+
+template <typename Metric, typename Value, typename Label>
+bool assign_scalar(const PixelPlanes &dataset, const size_t begin,
+                   const size_t end, const Mean *means, const uint32_t K,
+                   Label *classes) {
+  Value distance, minimum; // (2, 0, 0)
+  size_t new_class = 0;    // (1, 0, 0)
+  bool changed = false;    // (1, 0, 0)
+
+  for (size_t i = begin; i < end; ++i) {
+    // g14(1, 0, 1); gr4(1, 1, 1); ex4 = (4, 0, 1) + N * (gr5 + ex5)
+    minimum = std::numeric_limits<Value>::max(); // (1, 0, 0)
+    new_class = classes[i];                      // (1, 0, 0)
 
     for (uint32_t k = 0; k < K; ++k) {
-      // g16(1, 0, 1); gr6(1, 1, 1); ex6 = (4, 0, 0) + (6, 3, 1) = (10, 3, 1)
-      means[k].r = means[k].g = means[k].b = 0; // (3, 0, 0)
-      cluster_counter[k] = 0;                   // (1, 0, 0)
-
-      for (size_t i = 0; i < N; ++i) {
-        // g17(1, 0, 1); gr7(1, 1, 1); ex7 = (7, 4, 1)
-        if (classes[i] == k) {        // (0, 0, 1) + 3 * (2, 1, 0) + (1, 1, 0)
-          means[k].r += dataset[i].r; // (2, 1, 0)
-          means[k].g += dataset[i].g; // (2, 1, 0)
-          means[k].b += dataset[i].b; // (2, 1, 0)
-          ++cluster_counter[k];       // (1, 1, 0)
-        }
-      }
+      // g15(1, 0, 1); gr5(1, 1, 1); ex5 = (16, 9, 1)
+      distance = // (1, 0 ,0)
+          Metric::template distance<Value>(dataset[i], means[k]); // sem sqrt
 
-      if (cluster_counter[k]) { // (0, 0, 1) + 3 * (2, 1, 0) = (6, 3, 1)
-        means[k].r /= cluster_counter[k]; // (2, 1, 0)
-        means[k].g /= cluster_counter[k]; // (2, 1, 0)
-        means[k].b /= cluster_counter[k]; // (2, 1, 0)
+      if (distance < minimum) { // (0, 0, 1) + 2*(1, 0, 0) = (2, 0, 1)
+        minimum = distance;     // (1, 0, 0)
+        new_class = k;          // (1, 0, 0)
       }
     }
-  }
-
-  const auto iterations_time_end = std::chrono::high_resolution_clock::now();
 
-  if (x == max_iterations) {
-    std::clog << "clustering finished due to MAX_ITERATIONS reached\n";
+    if (new_class != classes[i]) { // (0, 0, 1) + 2 * (1, 0, 0) = (2, 0, 1)
+      changed = true;
+      classes[i] = new_class;
+    }
   }
 
-  return {init_time_end - init_time_start,
-          iterations_time_end - iterations_time_start,
-          x,
-          max_iterations,
-          std::move(means_ptr),
-          std::move(classes_ptr)};
+  return changed;
 }
 
-std::unique_ptr<std::vector<PixelCoord>>
-load_dataset(const fs::path &file_location) {
-  int w, h, bpp;
-  uint8_t *const rgb_image =
-      stbi_load(file_location.string().c_str(), &w, &h, &bpp, IMAGE_CHANNELS);
+#ifdef KMEANS_X86_SIMD
+// Lanes of one SIMD register holding int32, float or double values. The
+// kernels widen the 8-bit channels to Value in registers and order pixels like
+// assign_scalar() of the same Value. double distances to the exact means are
+// the reference; float rounds the means and distances to float, int32 rounds
+// the means to integers and is then exact (3 * 255^2 < 2^31). float keeps the
+// int32 width, double halves it.
+template <typename Value> struct Avx2Vector {
+  using type = __m256i;
+};
+template <> struct Avx2Vector<float> {
+  using type = __m256;
+};
+template <> struct Avx2Vector<double> {
+  using type = __m256d;
+};
 
-  if (!rgb_image) {
-    throw std::domain_error(std::string("error loading image: ") +
-                            stbi_failure_reason() + " " +
-                            file_location.string());
+template <typename Value> struct Avx2Lanes {
+  static constexpr bool is_int = std::is_same<Value, int32_t>::value;
+  static constexpr bool is_float = std::is_same<Value, float>::value;
+  using vec = typename Avx2Vector<Value>::type;
+  static constexpr uint32_t width = sizeof(vec) / sizeof(Value);
+  // Vectors of pixels the kernels assign together, so the compare and blend
+  // chains of independent vectors overlap; two fill the 16 registers.
+  static constexpr uint32_t blocks = 2;
+
+  __attribute__((target("avx2"))) static inline vec
+  load(const uint8_t *channel) {
+    if constexpr (is_int) {
+      return _mm256_cvtepu8_epi32(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i *>(channel)));
+    } else if constexpr (is_float) {
+      return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i *>(channel))));
+    } else {
+      return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_loadu_si32(channel)));
+    }
   }
 
-  const auto height = static_cast<uint32_t>(h);
-  const auto width = static_cast<uint32_t>(w);
-  auto result_ptr = std::make_unique<std::vector<PixelCoord>>(width * height);
-  auto &result = *result_ptr;
+  __attribute__((target("avx2"))) static inline vec set1(const Value value) {
+    if constexpr (is_int) {
+      return _mm256_set1_epi32(value);
+    } else if constexpr (is_float) {
+      return _mm256_set1_ps(value);
+    } else {
+      return _mm256_set1_pd(value);
+    }
+  }
 
-  size_t dest, src_index = 0;
-  for (uint32_t i = 0; i < height; ++i) {
-    for (uint32_t j = 0; j < width; ++j) {
-      dest = static_cast<size_t>(i) * width + j;
+  __attribute__((target("avx2"))) static inline vec sub(const vec a,
+                                                        const vec b) {
+    if constexpr (is_int) {
+      return _mm256_sub_epi32(a, b);
+    } else if constexpr (is_float) {
+      return _mm256_sub_ps(a, b);
+    } else {
+      return _mm256_sub_pd(a, b);
+    }
+  }
 
-      result[dest].r = rgb_image[src_index++];
-      result[dest].g = rgb_image[src_index++];
-      result[dest].b = rgb_image[src_index++];
-      result[dest].x = j;
-      result[dest].y = i;
+  template <typename Metric>
+  __attribute__((target("avx2"))) static inline vec term(const vec d) {
+    if constexpr (Metric::squares) {
+      if constexpr (is_int) {
+        return _mm256_mullo_epi32(d, d);
+      } else if constexpr (is_float) {
+        return _mm256_mul_ps(d, d);
+      } else {
+        return _mm256_mul_pd(d, d);
+      }
+    } else if constexpr (is_int) {
+      return _mm256_abs_epi32(d);
+    } else if constexpr (is_float) {
+      return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), d);
+    } else {
+      return _mm256_andnot_pd(_mm256_set1_pd(-0.0), d);
     }
   }
 
-  stbi_image_free(rgb_image);
+  template <typename Metric>
+  __attribute__((target("avx2"))) static inline vec combine(const vec a,
+                                                            const vec b) {
+    if constexpr (Metric::sums) {
+      if constexpr (is_int) {
+        return _mm256_add_epi32(a, b);
+      } else if constexpr (is_float) {
+        return _mm256_add_ps(a, b);
+      } else {
+        return _mm256_add_pd(a, b);
+      }
+    } else if constexpr (is_int) {
+      return _mm256_max_epi32(a, b);
+    } else if constexpr (is_float) {
+      return _mm256_max_ps(a, b);
+    } else {
+      return _mm256_max_pd(a, b);
+    }
+  }
 
-  return result_ptr;
-}
+  // Keeps, lane by lane, the smaller of best and distance and the index of
+  // the kept one in best_k. Ties keep best, so the lowest k wins.
+  __attribute__((target("avx2"))) static inline void
+  keep_closer(vec &best, vec &best_k, const vec distance, const vec k) {
+    if constexpr (is_int) {
+      const __m256i closer = _mm256_cmpgt_epi32(best, distance);
+      best = _mm256_min_epi32(best, distance);
+      best_k = _mm256_blendv_epi8(best_k, k, closer);
+    } else if constexpr (is_float) {
+      const __m256 closer = _mm256_cmp_ps(distance, best, _CMP_LT_OQ);
+      best = _mm256_blendv_ps(best, distance, closer);
+      best_k = _mm256_blendv_ps(best_k, k, closer);
+    } else {
+      const __m256d closer = _mm256_cmp_pd(distance, best, _CMP_LT_OQ);
+      best = _mm256_blendv_pd(best, distance, closer);
+      best_k = _mm256_blendv_pd(best_k, k, closer);
+    }
+  }
 
-void write_result_csv(std::ofstream &file, const KMeansResult &result,
-                      const uint16_t i,
-                      const std::vector<KMeansOutputType> types) {
-  if (i == 1) {
-    for (size_t j = 0; j < types.size(); j++) {
-      if (j != 0)
-        file << ',';
-      file << output_type_to_string(types[j]);
+  __attribute__((target("avx2"))) static inline void store(Value *out,
+                                                           const vec v) {
+    if constexpr (is_int) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), v);
+    } else if constexpr (is_float) {
+      _mm256_storeu_ps(out, v);
+    } else {
+      _mm256_storeu_pd(out, v);
     }
-    file << '\n';
   }
+};
 
-  for (size_t j = 0; j < types.size(); j++) {
-    if (j != 0)
-      file << ',';
-    if (types[j] != KMeansOutputType::IterationCount) {
-      file << result.from_output_type(types[j]).count();
+template <typename Value> struct Avx512Vector {
+  using type = __m512i;
+};
+template <> struct Avx512Vector<float> {
+  using type = __m512;
+};
+template <> struct Avx512Vector<double> {
+  using type = __m512d;
+};
+
+template <typename Value> struct Avx512Lanes {
+  static constexpr bool is_int = std::is_same<Value, int32_t>::value;
+  static constexpr bool is_float = std::is_same<Value, float>::value;
+  using vec = typename Avx512Vector<Value>::type;
+  static constexpr uint32_t width = sizeof(vec) / sizeof(Value);
+  // As in Avx2Lanes; the 32 registers hold four.
+  static constexpr uint32_t blocks = 4;
+
+  __attribute__((target("avx512f"))) static inline vec
+  load(const uint8_t *channel) {
+    if constexpr (is_int) {
+      return _mm512_maskz_cvtepu8_epi32(
+          0xFFFF,
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(channel)));
+    } else if constexpr (is_float) {
+      return _mm512_maskz_cvtepi32_ps(
+          0xFFFF, _mm512_maskz_cvtepu8_epi32(
+                      0xFFFF, _mm_loadu_si128(
+                                  reinterpret_cast<const __m128i *>(channel))));
     } else {
-      file << result.iterations_count;
+      return _mm512_maskz_cvtepi32_pd(
+          0xFF, _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+                    reinterpret_cast<const __m128i *>(channel))));
     }
   }
-  file << '\n';
-}
 
-void write_result_csv(std::ofstream &file, const KMeansResultMean &result_mean,
+  __attribute__((target("avx512f"))) static inline vec set1(const Value value) {
+    if constexpr (is_int) {
+      return _mm512_set1_epi32(value);
+    } else if constexpr (is_float) {
+      return _mm512_set1_ps(value);
+    } else {
+      return _mm512_set1_pd(value);
+    }
+  }
+
+  __attribute__((target("avx512f"))) static inline vec sub(const vec a,
+                                                           const vec b) {
+    if constexpr (is_int) {
+      return _mm512_sub_epi32(a, b);
+    } else if constexpr (is_float) {
+      return _mm512_sub_ps(a, b);
+    } else {
+      return _mm512_sub_pd(a, b);
+    }
+  }
+
+  template <typename Metric>
+  __attribute__((target("avx512f"))) static inline vec term(const vec d) {
+    if constexpr (Metric::squares) {
+      if constexpr (is_int) {
+        return _mm512_mullo_epi32(d, d);
+      } else if constexpr (is_float) {
+        return _mm512_mul_ps(d, d);
+      } else {
+        return _mm512_mul_pd(d, d);
+      }
+    } else if constexpr (is_int) {
+      return _mm512_maskz_abs_epi32(0xFFFF, d);
+    } else if constexpr (is_float) {
+      return _mm512_abs_ps(d);
+    } else {
+      return _mm512_abs_pd(d);
+    }
+  }
+
+  template <typename Metric>
+  __attribute__((target("avx512f"))) static inline vec combine(const vec a,
+                                                               const vec b) {
+    if constexpr (Metric::sums) {
+      if constexpr (is_int) {
+        return _mm512_add_epi32(a, b);
+      } else if constexpr (is_float) {
+        return _mm512_add_ps(a, b);
+      } else {
+        return _mm512_add_pd(a, b);
+      }
+    } else if constexpr (is_int) {
+      return _mm512_maskz_max_epi32(0xFFFF, a, b);
+    } else if constexpr (is_float) {
+      return _mm512_maskz_max_ps(0xFFFF, a, b);
+    } else {
+      return _mm512_maskz_max_pd(0xFF, a, b);
+    }
+  }
+
+  __attribute__((target("avx512f"))) static inline void
+  keep_closer(vec &best, vec &best_k, const vec distance, const vec k) {
+    if constexpr (is_int) {
+      const __mmask16 closer = _mm512_cmplt_epi32_mask(distance, best);
+      best = _mm512_mask_blend_epi32(closer, best, distance);
+      best_k = _mm512_mask_blend_epi32(closer, best_k, k);
+    } else if constexpr (is_float) {
+      const __mmask16 closer = _mm512_cmp_ps_mask(distance, best, _CMP_LT_OQ);
+      best = _mm512_mask_blend_ps(closer, best, distance);
+      best_k = _mm512_mask_blend_ps(closer, best_k, k);
+    } else {
+      const __mmask8 closer = _mm512_cmp_pd_mask(distance, best, _CMP_LT_OQ);
+      best = _mm512_mask_blend_pd(closer, best, distance);
+      best_k = _mm512_mask_blend_pd(closer, best_k, k);
+    }
+  }
+
+  __attribute__((target("avx512f"))) static inline void store(Value *out,
+                                                              const vec v) {
+    if constexpr (is_int) {
+      _mm512_storeu_si512(out, v);
+    } else if constexpr (is_float) {
+      _mm512_storeu_ps(out, v);
+    } else {
+      _mm512_storeu_pd(out, v);
+    }
+  }
+};
+
+template <typename Metric, typename Value, typename Label>
+__attribute__((target("avx2"))) bool
+assign_avx2(const PixelPlanes &dataset, const size_t begin, const size_t end,
+            const Mean *means, const uint32_t K, Label *classes) {
+  using Lanes = Avx2Lanes<Value>;
+  using vec = typename Lanes::vec;
+  constexpr uint32_t width = Lanes::width;
+  constexpr uint32_t blocks = Lanes::blocks;
+  Value labels[width];
+  bool changed = false;
+
+  size_t i = begin;
+  for (; i + blocks * width <= end; i += blocks * width) {
+    vec r[blocks], g[blocks], b[blocks], best[blocks], best_k[blocks];
+    for (uint32_t u = 0; u < blocks; ++u) {
+      r[u] = Lanes::load(&dataset.r[i + u * width]);
+      g[u] = Lanes::load(&dataset.g[i + u * width]);
+      b[u] = Lanes::load(&dataset.b[i + u * width]);
+      best[u] = Lanes::set1(std::numeric_limits<Value>::max());
+      best_k[u] = Lanes::set1(0);
+    }
+
+    for (uint32_t k = 0; k < K; ++k) {
+      const vec mr = Lanes::set1(as_value<Value>(means[k].r));
+      const vec mg = Lanes::set1(as_value<Value>(means[k].g));
+      const vec mb = Lanes::set1(as_value<Value>(means[k].b));
+      const vec index = Lanes::set1(k);
+      for (uint32_t u = 0; u < blocks; ++u) {
+        const vec distance = Lanes::template combine<Metric>(
+            Lanes::template combine<Metric>(
+                Lanes::template term<Metric>(Lanes::sub(r[u], mr)),
+                Lanes::template term<Metric>(Lanes::sub(g[u], mg))),
+            Lanes::template term<Metric>(Lanes::sub(b[u], mb)));
+        Lanes::keep_closer(best[u], best_k[u], distance, index);
+      }
+    }
+
+    for (uint32_t u = 0; u < blocks; ++u) {
+      Lanes::store(labels, best_k[u]);
+      for (size_t j = 0; j < width; ++j) {
+        const size_t p = i + u * width + j;
+        if (static_cast<size_t>(labels[j]) != classes[p]) {
+          changed = true;
+          classes[p] = labels[j];
+        }
+      }
+    }
+  }
+
+  for (; i + width <= end; i += width) {
+    const vec r = Lanes::load(&dataset.r[i]);
+    const vec g = Lanes::load(&dataset.g[i]);
+    const vec b = Lanes::load(&dataset.b[i]);
+
+    vec best = Lanes::set1(std::numeric_limits<Value>::max());
+    vec best_k = Lanes::set1(0);
+
+    for (uint32_t k = 0; k < K; ++k) {
+      const vec dr = Lanes::sub(r, Lanes::set1(as_value<Value>(means[k].r)));
+      const vec dg = Lanes::sub(g, Lanes::set1(as_value<Value>(means[k].g)));
+      const vec db = Lanes::sub(b, Lanes::set1(as_value<Value>(means[k].b)));
+      const vec distance = Lanes::template combine<Metric>(
+          Lanes::template combine<Metric>(Lanes::template term<Metric>(dr),
+                                          Lanes::template term<Metric>(dg)),
+          Lanes::template term<Metric>(db));
+
+      Lanes::keep_closer(best, best_k, distance, Lanes::set1(k));
+    }
+
+    Lanes::store(labels, best_k);
+    for (size_t j = 0; j < width; ++j) {
+      if (static_cast<size_t>(labels[j]) != classes[i + j]) {
+        changed = true;
+        classes[i + j] = labels[j];
+      }
+    }
+  }
+
+  const bool tail_changed =
+      assign_scalar<Metric, Value, Label>(dataset, i, end, means, K, classes);
+
+  return changed || tail_changed;
+}
+
+template <typename Metric, typename Value, typename Label>
+__attribute__((target("avx512f"))) bool
+assign_avx512(const PixelPlanes &dataset, const size_t begin, const size_t end,
+              const Mean *means, const uint32_t K, Label *classes) {
+  using Lanes = Avx512Lanes<Value>;
+  using vec = typename Lanes::vec;
+  constexpr uint32_t width = Lanes::width;
+  constexpr uint32_t blocks = Lanes::blocks;
+  Value labels[width];
+  bool changed = false;
+
+  size_t i = begin;
+  for (; i + blocks * width <= end; i += blocks * width) {
+    vec r[blocks], g[blocks], b[blocks], best[blocks], best_k[blocks];
+    for (uint32_t u = 0; u < blocks; ++u) {
+      r[u] = Lanes::load(&dataset.r[i + u * width]);
+      g[u] = Lanes::load(&dataset.g[i + u * width]);
+      b[u] = Lanes::load(&dataset.b[i + u * width]);
+      best[u] = Lanes::set1(std::numeric_limits<Value>::max());
+      best_k[u] = Lanes::set1(0);
+    }
+
+    for (uint32_t k = 0; k < K; ++k) {
+      const vec mr = Lanes::set1(as_value<Value>(means[k].r));
+      const vec mg = Lanes::set1(as_value<Value>(means[k].g));
+      const vec mb = Lanes::set1(as_value<Value>(means[k].b));
+      const vec index = Lanes::set1(k);
+      for (uint32_t u = 0; u < blocks; ++u) {
+        const vec distance = Lanes::template combine<Metric>(
+            Lanes::template combine<Metric>(
+                Lanes::template term<Metric>(Lanes::sub(r[u], mr)),
+                Lanes::template term<Metric>(Lanes::sub(g[u], mg))),
+            Lanes::template term<Metric>(Lanes::sub(b[u], mb)));
+        Lanes::keep_closer(best[u], best_k[u], distance, index);
+      }
+    }
+
+    for (uint32_t u = 0; u < blocks; ++u) {
+      Lanes::store(labels, best_k[u]);
+      for (size_t j = 0; j < width; ++j) {
+        const size_t p = i + u * width + j;
+        if (static_cast<size_t>(labels[j]) != classes[p]) {
+          changed = true;
+          classes[p] = labels[j];
+        }
+      }
+    }
+  }
+
+  for (; i + width <= end; i += width) {
+    const vec r = Lanes::load(&dataset.r[i]);
+    const vec g = Lanes::load(&dataset.g[i]);
+    const vec b = Lanes::load(&dataset.b[i]);
+
+    vec best = Lanes::set1(std::numeric_limits<Value>::max());
+    vec best_k = Lanes::set1(0);
+
+    for (uint32_t k = 0; k < K; ++k) {
+      const vec dr = Lanes::sub(r, Lanes::set1(as_value<Value>(means[k].r)));
+      const vec dg = Lanes::sub(g, Lanes::set1(as_value<Value>(means[k].g)));
+      const vec db = Lanes::sub(b, Lanes::set1(as_value<Value>(means[k].b)));
+      const vec distance = Lanes::template combine<Metric>(
+          Lanes::template combine<Metric>(Lanes::template term<Metric>(dr),
+                                          Lanes::template term<Metric>(dg)),
+          Lanes::template term<Metric>(db));
+
+      Lanes::keep_closer(best, best_k, distance, Lanes::set1(k));
+    }
+
+    Lanes::store(labels, best_k);
+    for (size_t j = 0; j < width; ++j) {
+      if (static_cast<size_t>(labels[j]) != classes[i + j]) {
+        changed = true;
+        classes[i + j] = labels[j];
+      }
+    }
+  }
+
+  const bool tail_changed =
+      assign_scalar<Metric, Value, Label>(dataset, i, end, means, K, classes);
+
+  return changed || tail_changed;
+}
+#endif
+
+#ifdef KMEANS_X86_SIMD
+// Kernels compiled for at most KMAX means and Channels planes. Channels are
+// packed in pairs of 16-bit lanes so one Metric::pair_term() folds two of
+// them (a single madd_epi16 for the Euclidean metric); the means are packed
+// once per call and, for small KMAX, stay in vector registers for the whole
+// pass. The fully unrolled loop over the means keeps two independent running
+// minimums, merged with the lowest-k tie rule. Slots past the actual K hold a
+// mean far outside the 8-bit cube, so they never win.
+constexpr int32_t PADDING_MEAN = 1 << 12;
+
+template <uint32_t KMAX, uint32_t Channels>
+void pack_means(const Mean *means, const uint32_t K,
+                int32_t packed[KMAX][(Channels + 1) / 2]) {
+  for (uint32_t k = 0; k < KMAX; ++k) {
+    for (uint32_t c = 0; c < Channels; c += 2) {
+      const int32_t lo =
+          k < K ? as_value<int32_t>(channel(means[k], c)) : PADDING_MEAN;
+      const int32_t hi = c + 1 == Channels ? 0
+                         : k < K ? as_value<int32_t>(channel(means[k], c + 1))
+                                 : PADDING_MEAN;
+      packed[k][c / 2] = lo | hi << 16;
+    }
+  }
+}
+
+template <uint32_t KMAX, uint32_t Channels, typename Metric>
+struct Avx512Fixed {
+  static constexpr uint32_t PAIRS = (Channels + 1) / 2;
+
+  __attribute__((target("avx512f,avx512bw"))) static bool
+  assign(const PixelPlanes &dataset, const size_t begin, const size_t end,
+         const Mean *means, const uint32_t K, uint8_t *classes) {
+    int32_t centers[KMAX][PAIRS];
+    pack_means<KMAX, Channels>(means, K, centers);
+
+    alignas(64) int32_t labels[16];
+    bool changed = false;
+
+    size_t i = begin;
+    for (; i + 16 <= end; i += 16) {
+      __m512i pixel[PAIRS];
+      for (uint32_t c = 0; c < Channels; c += 2) {
+        pixel[c / 2] = _mm512_maskz_cvtepu8_epi32(
+            0xFFFF, _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                        dataset.plane(c) + i)));
+        if (c + 1 < Channels) {
+          const __m512i hi = _mm512_maskz_cvtepu8_epi32(
+              0xFFFF, _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                          dataset.plane(c + 1) + i)));
+          pixel[c / 2] = _mm512_or_si512(
+              pixel[c / 2], _mm512_maskz_slli_epi32(0xFFFF, hi, 16));
+        }
+      }
+
+      __m512i best[2], best_k[2];
+      for (uint32_t chain = 0; chain < 2; ++chain) {
+        best[chain] = _mm512_set1_epi32(std::numeric_limits<int32_t>::max());
+        best_k[chain] = _mm512_setzero_si512();
+      }
+
+#pragma GCC unroll 64
+      for (uint32_t k = 0; k < KMAX; ++k) {
+        __m512i distance = _mm512_setzero_si512();
+        for (uint32_t p = 0; p < PAIRS; ++p) {
+          const __m512i delta =
+              _mm512_sub_epi16(pixel[p], _mm512_set1_epi32(centers[k][p]));
+          distance = Avx512Lanes<int32_t>::combine<Metric>(
+              distance, Metric::pair_term(delta));
+        }
+
+        const uint32_t chain = k & 1;
+        const __mmask16 closer = _mm512_cmplt_epi32_mask(distance, best[chain]);
+        best[chain] = _mm512_mask_blend_epi32(closer, best[chain], distance);
+        best_k[chain] = _mm512_mask_blend_epi32(closer, best_k[chain],
+                                                _mm512_set1_epi32(k));
+      }
+
+      const __mmask16 second =
+          _mm512_cmplt_epi32_mask(best[1], best[0]) |
+          (_mm512_cmpeq_epi32_mask(best[1], best[0]) &
+           _mm512_cmplt_epi32_mask(best_k[1], best_k[0]));
+      _mm512_store_si512(labels,
+                         _mm512_mask_blend_epi32(second, best_k[0], best_k[1]));
+      for (size_t j = 0; j < 16; ++j) {
+        if (static_cast<size_t>(labels[j]) != classes[i + j]) {
+          changed = true;
+          classes[i + j] = labels[j];
+        }
+      }
+    }
+
+    const bool tail_changed =
+        assign_scalar<Metric, int32_t, uint8_t>(dataset, i, end, means,
+                                                K, classes);
+
+    return changed || tail_changed;
+  }
+};
+
+template <uint32_t KMAX, uint32_t Channels, typename Metric>
+struct Avx2Fixed {
+  static constexpr uint32_t PAIRS = (Channels + 1) / 2;
+
+  __attribute__((target("avx2"))) static bool
+  assign(const PixelPlanes &dataset, const size_t begin, const size_t end,
+         const Mean *means, const uint32_t K, uint8_t *classes) {
+    int32_t centers[KMAX][PAIRS];
+    pack_means<KMAX, Channels>(means, K, centers);
+
+    alignas(32) int32_t labels[8];
+    bool changed = false;
+
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+      __m256i pixel[PAIRS];
+      for (uint32_t c = 0; c < Channels; c += 2) {
+        pixel[c / 2] = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+            reinterpret_cast<const __m128i *>(dataset.plane(c) + i)));
+        if (c + 1 < Channels) {
+          const __m256i hi = _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+              reinterpret_cast<const __m128i *>(dataset.plane(c + 1) + i)));
+          pixel[c / 2] =
+              _mm256_or_si256(pixel[c / 2], _mm256_slli_epi32(hi, 16));
+        }
+      }
+
+      __m256i best[2], best_k[2];
+      for (uint32_t chain = 0; chain < 2; ++chain) {
+        best[chain] = _mm256_set1_epi32(std::numeric_limits<int32_t>::max());
+        best_k[chain] = _mm256_setzero_si256();
+      }
+
+#pragma GCC unroll 64
+      for (uint32_t k = 0; k < KMAX; ++k) {
+        __m256i distance = _mm256_setzero_si256();
+        for (uint32_t p = 0; p < PAIRS; ++p) {
+          const __m256i delta =
+              _mm256_sub_epi16(pixel[p], _mm256_set1_epi32(centers[k][p]));
+          distance = Avx2Lanes<int32_t>::combine<Metric>(
+              distance, Metric::pair_term(delta));
+        }
+
+        const uint32_t chain = k & 1;
+        const __m256i closer = _mm256_cmpgt_epi32(best[chain], distance);
+        best[chain] = _mm256_min_epi32(best[chain], distance);
+        best_k[chain] =
+            _mm256_blendv_epi8(best_k[chain], _mm256_set1_epi32(k), closer);
+      }
+
+      const __m256i second = _mm256_or_si256(
+          _mm256_cmpgt_epi32(best[0], best[1]),
+          _mm256_and_si256(_mm256_cmpeq_epi32(best[0], best[1]),
+                           _mm256_cmpgt_epi32(best_k[0], best_k[1])));
+      _mm256_store_si256(reinterpret_cast<__m256i *>(labels),
+                         _mm256_blendv_epi8(best_k[0], best_k[1], second));
+      for (size_t j = 0; j < 8; ++j) {
+        if (static_cast<size_t>(labels[j]) != classes[i + j]) {
+          changed = true;
+          classes[i + j] = labels[j];
+        }
+      }
+    }
+
+    const bool tail_changed =
+        assign_scalar<Metric, int32_t, uint8_t>(dataset, i, end, means,
+                                                K, classes);
+
+    return changed || tail_changed;
+  }
+};
+
+// Runtime dispatch over the compiled K values: the ones used in
+// `experimental` exactly, anything else up to 64 in a power-of-two bucket.
+// Returns nullptr when K is larger than every bucket. K <= 64 always gets
+// 8-bit labels, so these are the only ones the fixed kernels write.
+template <template <uint32_t, uint32_t, typename> class Fixed, typename Metric>
+AssignKernel<uint8_t> fixed_kernel(const uint32_t K) {
+  switch (K) {
+  case 5:
+    return Fixed<5, IMAGE_CHANNELS, Metric>::assign;
+  case 15:
+    return Fixed<15, IMAGE_CHANNELS, Metric>::assign;
+  case 30:
+    return Fixed<30, IMAGE_CHANNELS, Metric>::assign;
+  case 45:
+    return Fixed<45, IMAGE_CHANNELS, Metric>::assign;
+  }
+
+  if (K <= 4) {
+    return Fixed<4, IMAGE_CHANNELS, Metric>::assign;
+  }
+  if (K <= 8) {
+    return Fixed<8, IMAGE_CHANNELS, Metric>::assign;
+  }
+  if (K <= 16) {
+    return Fixed<16, IMAGE_CHANNELS, Metric>::assign;
+  }
+  if (K <= 32) {
+    return Fixed<32, IMAGE_CHANNELS, Metric>::assign;
+  }
+  if (K <= 64) {
+    return Fixed<64, IMAGE_CHANNELS, Metric>::assign;
+  }
+  return nullptr;
+}
+#endif
+
+template <typename Label> struct AssignEngine {
+  const char *name;
+  AssignKernel<Label> kernel;
+  AssignKernel<Label> (*fixed)(const uint32_t K);
+
+  // The kernel specialized for K means, or the generic one.
+  inline AssignKernel<Label> for_k(const uint32_t K) const {
+    const AssignKernel<Label> specialized = fixed ? fixed(K) : nullptr;
+    return specialized ? specialized : kernel;
+  }
+};
+
+// Picks the widest assignment kernel supported by the running CPU. The
+// fixed-K kernels only exist for the int32 distances and 8-bit labels.
+template <typename Metric, typename Value, typename Label>
+AssignEngine<Label> select_assign_engine() {
+#ifdef KMEANS_X86_SIMD
+  constexpr bool fixed = std::is_same<Value, int32_t>::value &&
+                         std::is_same<Label, uint8_t>::value;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    if constexpr (fixed) {
+      if (__builtin_cpu_supports("avx512bw")) {
+        return {"avx512", assign_avx512<Metric, Value, Label>,
+                fixed_kernel<Avx512Fixed, Metric>};
+      }
+    }
+    return {"avx512", assign_avx512<Metric, Value, Label>, nullptr};
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    if constexpr (fixed) {
+      return {"avx2", assign_avx2<Metric, Value, Label>,
+              fixed_kernel<Avx2Fixed, Metric>};
+    }
+    return {"avx2", assign_avx2<Metric, Value, Label>, nullptr};
+  }
+#endif
+  return {"scalar", assign_scalar<Metric, Value, Label>, nullptr};
+}
+
+template <typename Metric, typename Value, typename Label>
+const AssignEngine<Label> &assign_engine() {
+  static const AssignEngine<Label> engine =
+      select_assign_engine<Metric, Value, Label>();
+  return engine;
+}
+
+template <typename Metric, typename Label>
+const AssignEngine<Label> &assign_engine(const KMeansPrecision precision) {
+  switch (precision) {
+  case KMeansPrecision::Float32:
+    return assign_engine<Metric, float, Label>();
+  case KMeansPrecision::Float64:
+    return assign_engine<Metric, double, Label>();
+  default:
+    return assign_engine<Metric, int32_t, Label>();
+  }
+}
+
+// Unique colors of a dataset with the number of pixels of each one, plus the
+// color index of every pixel so labels can be expanded back to pixels.
+struct ColorHistogram {
+  std::unique_ptr<PixelPlanes> colors;
+  std::vector<uint32_t> counts, color_of;
+
+  explicit ColorHistogram(const PixelPlanes &dataset) : color_of(dataset.size) {
+    for (size_t i = 0; i < dataset.size; ++i) {
+      color_of[i] = color_key(dataset[i]);
+    }
+
+    std::vector<uint32_t> keys(color_of);
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+    colors = std::make_unique<PixelPlanes>(keys.size(), 1);
+    counts.assign(keys.size(), 0);
+    for (size_t c = 0; c < keys.size(); ++c) {
+      colors->r[c] = keys[c] >> 16;
+      colors->g[c] = (keys[c] >> 8) & 0xFF;
+      colors->b[c] = keys[c] & 0xFF;
+    }
+
+    for (auto &color : color_of) {
+      color = std::lower_bound(keys.begin(), keys.end(), color) - keys.begin();
+      ++counts[color];
+    }
+  }
+
+  static inline uint32_t color_key(const Pixel &pixel) {
+    return static_cast<uint32_t>(pixel.r) << 16 |
+           static_cast<uint32_t>(pixel.g) << 8 | static_cast<uint32_t>(pixel.b);
+  }
+};
+
+PixelPlanes::~PixelPlanes() = default;
+
+const ColorHistogram &PixelPlanes::histogram() const {
+  std::call_once(histogram_once, [this] {
+    histogram_ptr = std::make_unique<ColorHistogram>(*this);
+  });
+  return *histogram_ptr;
+}
+
+const PixelPlanes &PixelPlanes::half() const {
+  std::call_once(half_once, [this] {
+    half_ptr = std::make_unique<PixelPlanes>(width / 2, height / 2);
+    auto &half = *half_ptr;
+    for (uint32_t c = 0; c < IMAGE_CHANNELS; ++c) {
+      const uint8_t *const source = plane(c);
+      uint8_t *const target = c == 0 ? half.r : c == 1 ? half.g : half.b;
+      for (size_t y = 0; y < half.height; ++y) {
+        const uint8_t *const top = source + 2 * y * width;
+        const uint8_t *const bottom = top + width;
+        for (size_t x = 0; x < half.width; ++x) {
+          target[y * half.width + x] =
+              (top[2 * x] + top[2 * x + 1] + bottom[2 * x] +
+               bottom[2 * x + 1] + 2) /
+              4;
+        }
+      }
+    }
+  });
+  return *half_ptr;
+}
+
+// Per-cluster channel sums and (weighted) pixel counts for the update step,
+// filled in a single sweep over the classes. Sums are 64-bit so large images
+// cannot overflow them.
+struct ClusterSums {
+  std::vector<int64_t> r, g, b;
+  std::vector<uint64_t> count;
+
+  explicit ClusterSums(const uint32_t K) : r(K), g(K), b(K), count(K) {}
+
+  void resize(const uint32_t K) {
+    r.resize(K);
+    g.resize(K);
+    b.resize(K);
+    count.resize(K);
+  }
+
+  ClusterSums &operator+=(const ClusterSums &other) {
+    for (size_t k = 0; k < count.size(); ++k) {
+      r[k] += other.r[k];
+      g[k] += other.g[k];
+      b[k] += other.b[k];
+      count[k] += other.count[k];
+    }
+
+    return *this;
+  }
+
+  void reset() {
+    std::fill(r.begin(), r.end(), 0);
+    std::fill(g.begin(), g.end(), 0);
+    std::fill(b.begin(), b.end(), 0);
+    std::fill(count.begin(), count.end(), 0);
+  }
+
+  template <typename Label>
+  void accumulate(const PixelPlanes &points, const uint32_t *weights,
+                  const Label *classes, const size_t begin, const size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      const size_t k = classes[i];
+      const uint32_t weight = weights ? weights[i] : 1;
+      r[k] += static_cast<int64_t>(points.r[i]) * weight;
+      g[k] += static_cast<int64_t>(points.g[i]) * weight;
+      b[k] += static_cast<int64_t>(points.b[i]) * weight;
+      count[k] += weight;
+    }
+  }
+
+  // Moves point i (with its weight) from cluster `from` to cluster `to`.
+  // Counts may wrap below zero in a partial sum of moves; they are exact
+  // once added to the full sums.
+  inline void move(const PixelPlanes &points, const uint32_t *weights,
+                   const size_t i, const size_t from, const size_t to) {
+    const uint32_t weight = weights ? weights[i] : 1;
+    const int64_t pr = static_cast<int64_t>(points.r[i]) * weight;
+    const int64_t pg = static_cast<int64_t>(points.g[i]) * weight;
+    const int64_t pb = static_cast<int64_t>(points.b[i]) * weight;
+    r[from] -= pr;
+    g[from] -= pg;
+    b[from] -= pb;
+    count[from] -= weight;
+    r[to] += pr;
+    g[to] += pg;
+    b[to] += pb;
+    count[to] += weight;
+  }
+
+  // The exact means of the clusters; truncating them to integers pulled
+  // every centroid towards 0 and left runs flip-flopping or stuck on poor
+  // clusterings. Empty clusters collapse to (0, 0, 0), as in the original
+  // update step.
+  void means(std::vector<Mean> &means) const {
+    for (size_t k = 0; k < means.size(); ++k) {
+      if (count[k]) {
+        const double n = static_cast<double>(count[k]);
+        means[k] = {r[k] / n, g[k] / n, b[k] / n};
+      } else {
+        means[k] = {0, 0, 0};
+      }
+    }
+  }
+};
+
+// Buffers of the assignment policies, owned by a KMeansWorkspace so bounds
+// and thread-private sums survive from one run to the next. Each policy
+// resizes the ones it uses when constructed; their contents are rebuilt by
+// the first pass of every run.
+struct AssignmentBuffers {
+  std::vector<double> upper, lower, centers, half_min, drift;
+  // Lloyd: thread-private sums and changed counts.
+  std::vector<ClusterSums> partial_sums;
+  std::vector<size_t> partial_changed;
+  // Bounded algorithms: pixels relabeled by the last pass and their
+  // previous labels.
+  std::vector<size_t> moved;
+  std::vector<uint32_t> moved_from;
+  // Elkan: the N * K lower bounds, rounded down to float.
+  std::vector<float> narrow_lower;
+  // Lazy drift: the total distance every mean has moved so far.
+  std::vector<double> travelled;
+  // Yinyang: groups of means, the means listed group by group, per-group
+  // bounds and grouping scratch.
+  std::vector<uint32_t> group_of, group_begin, grouped_k, group_first_k,
+      group_counter, group_index;
+  std::vector<double> group_drift, group_travelled, group_first, group_second,
+      distances;
+  std::vector<Mean> group_centers, grouped_means;
+  std::vector<uint8_t> scanned;
+};
+
+// Base of the assignment policies: the workspace buffers are moved in for the
+// run and moved back when the policy goes away, keeping their capacity while
+// the inner loops access them as plain members.
+struct BorrowedBuffers : AssignmentBuffers {
+  AssignmentBuffers &home;
+
+  // Whether the pass in progress records the pixels it relabels. Exhaustive
+  // first passes relabel nearly every pixel and are summed in full.
+  bool tracking = false;
+
+  explicit BorrowedBuffers(AssignmentBuffers &_home)
+      : AssignmentBuffers(std::move(_home)), home(_home) {}
+
+  ~BorrowedBuffers() {
+    home = std::move(static_cast<AssignmentBuffers &>(*this));
+  }
+
+  inline void begin_pass(const bool track) {
+    tracking = track;
+    moved.clear();
+    moved_from.clear();
+  }
+
+  template <typename Label>
+  inline void relabel(std::vector<Label> &classes, const size_t i,
+                      const size_t label) {
+    if (tracking) {
+      moved.push_back(i);
+      moved_from.push_back(classes[i]);
+    }
+    classes[i] = label;
+  }
+
+  // Brings sums up to date with the labels of the last pass: the recorded
+  // pixels move between clusters, O(changed), or every point is summed
+  // again after an untracked pass.
+  template <typename Label>
+  void update_sums(const PixelPlanes &points, const size_t N,
+                   const uint32_t *weights, const std::vector<Label> &classes,
+                   ClusterSums &sums) const {
+    if (!tracking) {
+      sums.reset();
+      sums.accumulate(points, weights, classes.data(), 0, N);
+      return;
+    }
+
+    for (size_t j = 0; j < moved.size(); ++j) {
+      sums.move(points, weights, moved[j], moved_from[j], classes[moved[j]]);
+    }
+  }
+};
+
+// Assignment policies plugged into kmeans_with(). assign() runs the
+// nearest-centroid step and returns how many classes changed;
+// means_moved() is called after every update step with the previous means.
+// Policies with fuses_sums fill the ClusterSums during the assignment and
+// provide assign_and_sum() instead of assign(); the others leave it to
+// update_sums(). Either way the
+// sums are rebuilt only on the first pass and then follow the changed
+// classes. Classes are stored as Label, the narrowest type that holds K.
+template <typename Metric, typename Label>
+struct LloydAssignment : BorrowedBuffers {
+  using label = Label;
+  static constexpr bool tracks_drift = false;
+  static constexpr bool fuses_sums = true;
+  // Pixels assigned per kernel call, so they are summed while still cached.
+  static constexpr size_t CHUNK = 4096;
+
+  // Assignment kernel of the requested precision, specialized for K if
+  // possible.
+  const AssignKernel<Label> kernel;
+  ThreadPool *const pool;
+
+  LloydAssignment(const size_t, const uint32_t K, const KMeansOptions &options,
+                  AssignmentBuffers &buffers)
+      : BorrowedBuffers(buffers),
+        kernel(assign_engine<Metric, Label>(options.precision).for_k(K)),
+        pool(resolve_threads(options.threads) > 1
+                 ? &thread_pool(resolve_threads(options.threads))
+                 : nullptr) {
+    // Thread-private sums, merged in thread order after every pass.
+    if (pool) {
+      while (partial_sums.size() < pool->size()) {
+        partial_sums.emplace_back(K);
+      }
+      for (auto &sums : partial_sums) {
+        sums.resize(K);
+      }
+      partial_changed.resize(pool->size());
+    }
+  }
+
+  // Assigns points [0, N) and adds them to sums: every point on a full pass,
+  // only the moves between clusters on an incremental one, where sums hold
+  // the previous classes. Returns how many classes changed.
+  size_t assign_and_sum(const PixelPlanes &dataset, const size_t N,
+                        const uint32_t *weights,
+                        const std::vector<Mean> &means, Label *classes,
+                        ClusterSums &sums, const bool incremental) {
+    if (!pool) {
+      return assign_and_sum_range(dataset, 0, N, weights, means, classes, sums,
+                                  incremental);
+    }
+
+    // Static partitioning by thread index keeps the result deterministic.
+    const uint32_t threads = pool->size();
+    pool->run([&](const uint32_t t) {
+      partial_sums[t].reset();
+      partial_changed[t] = assign_and_sum_range(
+          dataset, N * t / threads, N * (t + 1) / threads, weights, means,
+          classes, partial_sums[t], incremental);
+    });
+
+    size_t changed = 0;
+    for (uint32_t t = 0; t < threads; ++t) {
+      changed += partial_changed[t];
+      sums += partial_sums[t];
+    }
+
+    return changed;
+  }
+
+  void means_moved(const std::vector<Mean> &, const std::vector<Mean> &,
+                   const std::vector<Label> &) {}
+
+private:
+  size_t assign_and_sum_range(const PixelPlanes &dataset, const size_t first,
+                              const size_t last, const uint32_t *weights,
+                              const std::vector<Mean> &means, Label *classes,
+                              ClusterSums &sums,
+                              const bool incremental) const {
+    size_t changed = 0;
+    Label previous[CHUNK];
+
+    for (size_t begin = first; begin < last; begin += CHUNK) {
+      const size_t end = std::min(begin + CHUNK, last);
+      std::copy(classes + begin, classes + end, previous);
+      kernel(dataset, begin, end, means.data(), means.size(), classes);
+      if (!incremental) {
+        sums.accumulate(dataset, weights, classes, begin, end);
+      }
+
+      for (size_t i = begin; i < end; ++i) {
+        const size_t from = previous[i - begin];
+        if (from != classes[i]) {
+          ++changed;
+          if (incremental) {
+            sums.move(dataset, weights, i, from, classes[i]);
+          }
+        }
+      }
+    }
+
+    return changed;
+  }
+};
+
+// Bounds are compared with this slack so the rounding error accumulated by
+// the drift updates can never prune a centroid that Lloyd would pick. The
+// slack only costs a few extra distance evaluations; it never changes which
+// of the evaluated candidates wins.
+constexpr double BOUND_EPSILON = 1e-6;
+
+// Rounds a non-negative bound down to a float, which is still a lower bound:
+// shrinking it by 2^-23 first outweighs the 2^-24 relative error of rounding
+// to nearest.
+inline float float_below(const double bound) {
+  return static_cast<float>(bound * (1.0 - 0x1p-23));
+}
+
+// Elkan's algorithm: one upper bound per pixel, K lower bounds per pixel and
+// the centroid-to-centroid distances let most distance evaluations be skipped
+// through the triangle inequality. Candidates that survive the bounds are
+// compared with the double distances of the float64 Lloyd kernels, so labels
+// match Lloyd's. The drift of the means is applied lazily: bounds are stored
+// offset by the total drift of their mean, so an update step costs O(K)
+// instead of rewriting the N * K lower bounds, which are floats to halve
+// their memory traffic.
+template <typename Metric, typename Label>
+struct ElkanAssignment : BorrowedBuffers {
+  using label = Label;
+  static constexpr bool tracks_drift = true;
+  static constexpr bool fuses_sums = false;
+
+  const uint32_t K;
+  bool bounded = false;
+
+  ElkanAssignment(const size_t N, const uint32_t _K, const KMeansOptions &,
+                  AssignmentBuffers &buffers)
+      : BorrowedBuffers(buffers), K(_K) {
+    upper.resize(N);
+    narrow_lower.resize(N * K);
+    centers.resize(K * K);
+    half_min.resize(K);
+    drift.resize(K);
+    travelled.assign(K, 0.0);
+  }
+
+  size_t assign(const PixelPlanes &dataset, const size_t N,
+                const std::vector<Mean> &means, std::vector<Label> &classes) {
+    if (!bounded) {
+      bounded = true;
+      begin_pass(false);
+      return assign_exhaustive(dataset, N, means, classes);
+    }
+    begin_pass(true);
+
+    for (uint32_t k = 0; k < K; ++k) {
+      half_min[k] = std::numeric_limits<double>::max();
+    }
+    for (uint32_t k = 0; k < K; ++k) {
+      for (uint32_t c = k + 1; c < K; ++c) {
+        const double half =
+            0.5 * Metric::bound(
+                      Metric::template distance<double>(means[k], means[c]));
+        centers[k * K + c] = centers[c * K + k] = half;
+        half_min[k] = std::min(half_min[k], half);
+        half_min[c] = std::min(half_min[c], half);
+      }
+    }
+
+    // upper[i] + travelled[a] and l[c] - travelled[c] are the current
+    // bounds: the drift since they were stored loosens them.
+    const double *const offset = travelled.data();
+    size_t changed = 0;
+    for (size_t i = 0; i < N; ++i) {
+      size_t a = classes[i];
+      double u = upper[i] + offset[a];
+      if (u + BOUND_EPSILON < half_min[a]) {
+        continue;
+      }
+
+      // Tightening the upper bound first settles most of the remaining
+      // pixels without reading their lower bounds.
+      const Pixel pixel = dataset[i];
+      double a_distance = Metric::template distance<double>(pixel, means[a]);
+      u = Metric::bound(a_distance);
+      if (u + BOUND_EPSILON < half_min[a]) {
+        upper[i] = u - offset[a];
+        continue;
+      }
+
+      float *const l = &narrow_lower[i * K];
+      l[a] = float_below(u + offset[a]);
+      for (uint32_t c = 0; c < K; ++c) {
+        if (c == a || u + BOUND_EPSILON < centers[a * K + c] ||
+            u + BOUND_EPSILON < l[c] - offset[c]) {
+          continue;
+        }
+
+        const double distance =
+            Metric::template distance<double>(pixel, means[c]);
+        const double c_bound = Metric::bound(distance);
+        l[c] = float_below(c_bound + offset[c]);
+        if (distance < a_distance || (distance == a_distance && c < a)) {
+          a = c;
+          a_distance = distance;
+          u = c_bound;
+        }
+      }
+
+      upper[i] = u - offset[a];
+      if (a != classes[i]) {
+        ++changed;
+        relabel(classes, i, a);
+      }
+    }
+
+    return changed;
+  }
+
+  void means_moved(const std::vector<Mean> &previous,
+                   const std::vector<Mean> &means, const std::vector<Label> &) {
+    for (uint32_t k = 0; k < K; ++k) {
+      drift[k] = Metric::bound(
+          Metric::template distance<double>(previous[k], means[k]));
+    }
+    for (uint32_t k = 0; k < K; ++k) {
+      travelled[k] += drift[k];
+    }
+  }
+
+private:
+  // First pass: every distance is computed, seeding tight bounds.
+  size_t assign_exhaustive(const PixelPlanes &dataset, const size_t N,
+                           const std::vector<Mean> &means,
+                           std::vector<Label> &classes) {
+    size_t changed = 0;
+    for (size_t i = 0; i < N; ++i) {
+      const Pixel pixel = dataset[i];
+      float *const l = &narrow_lower[i * K];
+      double minimum = std::numeric_limits<double>::infinity();
+      size_t new_class = 0;
+
+      for (uint32_t k = 0; k < K; ++k) {
+        const double distance =
+            Metric::template distance<double>(pixel, means[k]);
+        l[k] = float_below(Metric::bound(distance) + travelled[k]);
+        if (distance < minimum) {
+          minimum = distance;
+          new_class = k;
+        }
+      }
+
+      upper[i] = Metric::bound(minimum) - travelled[new_class];
+      if (new_class != classes[i]) {
+        ++changed;
+        relabel(classes, i, new_class);
+      }
+    }
+
+    return changed;
+  }
+};
+
+// Hamerly's algorithm: a single upper bound (closest mean) and a single lower
+// bound (second closest mean) per pixel, so the extra memory is O(N) instead
+// of Elkan's O(N * K). A pixel whose bounds fail is rescanned against every
+// mean with the double distances.
+template <typename Metric, typename Label>
+struct HamerlyAssignment : BorrowedBuffers {
+  using label = Label;
+  static constexpr bool tracks_drift = true;
+  static constexpr bool fuses_sums = false;
+
+  const uint32_t K;
+  bool bounded = false;
+
+  HamerlyAssignment(const size_t N, const uint32_t _K, const KMeansOptions &,
+                    AssignmentBuffers &buffers)
+      : BorrowedBuffers(buffers), K(_K) {
+    upper.resize(N);
+    lower.resize(N);
+    half_min.resize(K);
+    drift.resize(K);
+  }
+
+  size_t assign(const PixelPlanes &dataset, const size_t N,
+                const std::vector<Mean> &means, std::vector<Label> &classes) {
+    begin_pass(bounded);
+    for (uint32_t k = 0; k < K; ++k) {
+      half_min[k] = std::numeric_limits<double>::max();
+    }
+    for (uint32_t k = 0; k < K; ++k) {
+      for (uint32_t c = k + 1; c < K; ++c) {
+        const double half =
+            0.5 * Metric::bound(
+                      Metric::template distance<double>(means[k], means[c]));
+        half_min[k] = std::min(half_min[k], half);
+        half_min[c] = std::min(half_min[c], half);
+      }
+    }
+
+    size_t changed = 0;
+    for (size_t i = 0; i < N; ++i) {
+      const Pixel pixel = dataset[i];
+      size_t a = classes[i];
+
+      if (bounded) {
+        const double bound = std::max(half_min[a], lower[i]);
+        if (upper[i] + BOUND_EPSILON < bound) {
+          continue;
+        }
+
+        upper[i] = Metric::bound(
+            Metric::template distance<double>(pixel, means[a]));
+        if (upper[i] + BOUND_EPSILON < bound) {
+          continue;
+        }
+      }
+
+      double first = std::numeric_limits<double>::infinity();
+      double second = std::numeric_limits<double>::infinity();
+      for (uint32_t k = 0; k < K; ++k) {
+        const double distance =
+            Metric::template distance<double>(pixel, means[k]);
+        if (distance < first) {
+          second = first;
+          first = distance;
+          a = k;
+        } else if (distance < second) {
+          second = distance;
+        }
+      }
+
+      upper[i] = Metric::bound(first);
+      lower[i] = Metric::bound(second);
+      if (a != classes[i]) {
+        ++changed;
+        relabel(classes, i, a);
+      }
+    }
+
+    bounded = true;
+    return changed;
+  }
+
+  void means_moved(const std::vector<Mean> &previous,
+                   const std::vector<Mean> &means,
+                   const std::vector<Label> &classes) {
+    uint32_t farthest = 0;
+    double first = 0.0, second = 0.0;
+    for (uint32_t k = 0; k < K; ++k) {
+      drift[k] = Metric::bound(
+          Metric::template distance<double>(previous[k], means[k]));
+      if (drift[k] > first) {
+        second = first;
+        first = drift[k];
+        farthest = k;
+      } else if (drift[k] > second) {
+        second = drift[k];
+      }
+    }
+
+    for (size_t i = 0; i < upper.size(); ++i) {
+      upper[i] += drift[classes[i]];
+      lower[i] -= classes[i] == farthest ? second : first;
+    }
+  }
+};
+
+// Yinyang's algorithm: the means are clustered once into about K / 10 groups
+// and every pixel keeps an upper bound plus one lower bound per group. The
+// global filter skips pixels whose upper bound is below every group bound or
+// half the distance to the mean closest to their own, and the group filter
+// skips whole groups. Every mean of a group that passes is rescanned: with
+// 3-D pixels a distance costs less than the per-mean filter it would replace,
+// so the rescan walks the group's means stored contiguously without branches
+// and only takes the bound of its two closest.
+template <typename Metric, typename Label>
+struct YinyangAssignment : BorrowedBuffers {
+  using label = Label;
+  static constexpr bool tracks_drift = true;
+  static constexpr bool fuses_sums = false;
+  static constexpr uint32_t MEANS_PER_GROUP = 10;
+  static constexpr uint32_t GROUPING_ITERATIONS = 5;
+
+  const uint32_t K;
+  bool bounded = false;
+  size_t groups = 0;
+
+  YinyangAssignment(const size_t N, const uint32_t _K, const KMeansOptions &,
+                    AssignmentBuffers &buffers)
+      : BorrowedBuffers(buffers), K(_K) {
+    group_of.resize(K);
+    grouped_k.resize(K);
+    grouped_means.resize(K);
+    upper.resize(N);
+    half_min.resize(K);
+    drift.resize(K);
+    travelled.assign(K, 0.0);
+  }
+
+  size_t assign(const PixelPlanes &dataset, const size_t N,
+                const std::vector<Mean> &means, std::vector<Label> &classes) {
+    if (!bounded) {
+      bounded = true;
+      group_means(means);
+      begin_pass(false);
+      return assign_exhaustive(dataset, N, means, classes);
+    }
+    begin_pass(true);
+
+    for (uint32_t j = 0; j < K; ++j) {
+      grouped_means[j] = means[grouped_k[j]];
+    }
+    for (uint32_t k = 0; k < K; ++k) {
+      half_min[k] = std::numeric_limits<double>::max();
+    }
+    for (uint32_t k = 0; k < K; ++k) {
+      for (uint32_t c = k + 1; c < K; ++c) {
+        const double half =
+            0.5 * Metric::bound(
+                      Metric::template distance<double>(means[k], means[c]));
+        half_min[k] = std::min(half_min[k], half);
+        half_min[c] = std::min(half_min[c], half);
+      }
+    }
+
+    // Bounds are stored offset by the total drift, as Elkan's: the current
+    // ones are upper[i] + travelled[a] and l[t] - group_travelled[t].
+    const size_t T = groups;
+    const double *const offset = travelled.data();
+    const double *const group_offset = group_travelled.data();
+    size_t changed = 0;
+
+    for (size_t i = 0; i < N; ++i) {
+      const size_t previous = classes[i];
+      double *const l = &lower[i * T];
+      double group_min = std::numeric_limits<double>::infinity();
+      for (size_t t = 0; t < T; ++t) {
+        group_min = std::min(group_min, l[t] - group_offset[t]);
+      }
+      const double global = std::max(group_min, half_min[previous]);
+      if (upper[i] + offset[previous] + BOUND_EPSILON < global) {
+        continue;
+      }
+
+      const Pixel pixel = dataset[i];
+      double a_distance =
+          Metric::template distance<double>(pixel, means[previous]);
+      const double previous_u = Metric::bound(a_distance);
+      double u = previous_u;
+      size_t a = previous;
+      if (u + BOUND_EPSILON < global) {
+        upper[i] = u - offset[previous];
+        continue;
+      }
+
+      for (size_t t = 0; t < T; ++t) {
+        scanned[t] = !(u + BOUND_EPSILON < l[t] - group_offset[t]);
+        if (!scanned[t]) {
+          continue;
+        }
+
+        // Ties keep the first, lowest, k of the group.
+        double first = std::numeric_limits<double>::infinity();
+        double second = first;
+        uint32_t first_j = group_begin[t];
+        for (uint32_t j = group_begin[t]; j < group_begin[t + 1]; ++j) {
+          const double distance =
+              Metric::template distance<double>(pixel, grouped_means[j]);
+          second = std::min(second, std::max(first, distance));
+          first_j = distance < first ? j : first_j;
+          first = std::min(first, distance);
+        }
+
+        const uint32_t c = grouped_k[first_j];
+        group_first[t] = first;
+        group_second[t] = second;
+        group_first_k[t] = c;
+        if (first < a_distance || (first == a_distance && c < a)) {
+          a = c;
+          a_distance = first;
+          u = Metric::bound(first);
+        }
+      }
+
+      for (size_t t = 0; t < T; ++t) {
+        if (scanned[t]) {
+          l[t] = Metric::bound(group_first_k[t] == a ? group_second[t]
+                                                     : group_first[t]) +
+                 group_offset[t];
+        } else if (t == group_of[previous] && a != previous) {
+          l[t] = std::min(l[t], previous_u + group_offset[t]);
+        }
+      }
+
+      upper[i] = u - offset[a];
+      if (a != previous) {
+        ++changed;
+        relabel(classes, i, a);
+      }
+    }
+
+    return changed;
+  }
+
+  void means_moved(const std::vector<Mean> &previous,
+                   const std::vector<Mean> &means, const std::vector<Label> &) {
+    for (size_t t = 0; t < groups; ++t) {
+      group_drift[t] = 0.0;
+      for (uint32_t j = group_begin[t]; j < group_begin[t + 1]; ++j) {
+        const uint32_t k = grouped_k[j];
+        drift[k] = Metric::bound(
+            Metric::template distance<double>(previous[k], means[k]));
+        travelled[k] += drift[k];
+        group_drift[t] = std::max(group_drift[t], drift[k]);
+      }
+      group_travelled[t] += group_drift[t];
+    }
+  }
+
+private:
+  // Clusters the initial means into groups with a few Lloyd iterations
+  // seeded by the first means. Groups left empty are dropped; the means are
+  // then listed group by group in grouped_k.
+  void group_means(const std::vector<Mean> &means) {
+    const uint32_t T = std::max<uint32_t>(K / MEANS_PER_GROUP, 1);
+    auto &centers = group_centers;
+    auto &counter = group_counter;
+    centers.assign(means.begin(), means.begin() + T);
+    counter.resize(T);
+
+    for (uint32_t iteration = 0; iteration < GROUPING_ITERATIONS; ++iteration) {
+      for (uint32_t k = 0; k < K; ++k) {
+        double minimum = std::numeric_limits<double>::infinity();
+        for (uint32_t t = 0; t < T; ++t) {
+          const double distance =
+              Metric::template distance<double>(means[k], centers[t]);
+          if (distance < minimum) {
+            minimum = distance;
+            group_of[k] = t;
+          }
+        }
+      }
+
+      for (uint32_t t = 0; t < T; ++t) {
+        centers[t] = {0, 0, 0};
+        counter[t] = 0;
+      }
+      for (uint32_t k = 0; k < K; ++k) {
+        centers[group_of[k]].r += means[k].r;
+        centers[group_of[k]].g += means[k].g;
+        centers[group_of[k]].b += means[k].b;
+        ++counter[group_of[k]];
+      }
+      for (uint32_t t = 0; t < T; ++t) {
+        if (counter[t]) {
+          centers[t].r /= counter[t];
+          centers[t].g /= counter[t];
+          centers[t].b /= counter[t];
+        }
+      }
+    }
+
+    group_index.assign(T, T);
+    groups = 0;
+    for (uint32_t t = 0; t < T; ++t) {
+      if (counter[t]) {
+        group_index[t] = groups++;
+      }
+    }
+
+    group_begin.assign(groups + 1, 0);
+    for (uint32_t k = 0; k < K; ++k) {
+      group_of[k] = group_index[group_of[k]];
+      ++group_begin[group_of[k] + 1];
+    }
+    for (size_t t = 0; t < groups; ++t) {
+      group_begin[t + 1] += group_begin[t];
+    }
+    for (size_t t = 0; t < groups; ++t) {
+      counter[t] = group_begin[t];
+    }
+    for (uint32_t k = 0; k < K; ++k) {
+      grouped_k[counter[group_of[k]]++] = k;
+    }
+
+    lower.resize(upper.size() * groups);
+    group_drift.resize(groups);
+    group_travelled.assign(groups, 0.0);
+    group_first.resize(groups);
+    group_second.resize(groups);
+    group_first_k.resize(groups);
+    scanned.resize(groups);
+  }
+
+  // First pass: every distance is computed, seeding tight bounds.
+  size_t assign_exhaustive(const PixelPlanes &dataset, const size_t N,
+                           const std::vector<Mean> &means,
+                           std::vector<Label> &classes) {
+    const size_t T = groups;
+    distances.resize(K);
+    size_t changed = 0;
+
+    for (size_t i = 0; i < N; ++i) {
+      const Pixel pixel = dataset[i];
+      double minimum = std::numeric_limits<double>::infinity();
+      size_t new_class = 0;
+
+      for (uint32_t k = 0; k < K; ++k) {
+        const double distance =
+            Metric::template distance<double>(pixel, means[k]);
+        distances[k] = Metric::bound(distance);
+        if (distance < minimum) {
+          minimum = distance;
+          new_class = k;
+        }
+      }
+
+      double *const l = &lower[i * T];
+      for (size_t t = 0; t < T; ++t) {
+        l[t] = std::numeric_limits<double>::infinity();
+        for (uint32_t j = group_begin[t]; j < group_begin[t + 1]; ++j) {
+          if (grouped_k[j] != new_class) {
+            l[t] = std::min(l[t], distances[grouped_k[j]]);
+          }
+        }
+      }
+
+      upper[i] = distances[new_class];
+      if (new_class != classes[i]) {
+        ++changed;
+        relabel(classes, i, new_class);
+      }
+    }
+
+    return changed;
+  }
+};
+
+// Draws an index in [0, weights.size()) with probability proportional to its
+// weight, or uniformly when every weight is zero.
+template <typename Weight>
+size_t sample_weighted(const std::vector<Weight> &weights, std::mt19937 &eng) {
+  long double total = 0.0;
+  for (const auto weight : weights) {
+    total += weight;
+  }
+
+  if (total <= 0.0) {
+    return std::uniform_int_distribution<size_t>(0, weights.size() - 1)(eng);
+  }
+
+  long double target =
+      std::uniform_real_distribution<long double>(0.0, total)(eng);
+  for (size_t i = 0; i < weights.size(); ++i) {
+    if (target < weights[i]) {
+      return i;
+    }
+    target -= weights[i];
+  }
+
+  return weights.size() - 1;
+}
+
+// Scratch of the seeding procedures, owned by a KMeansWorkspace.
+struct SeedingBuffers {
+  std::vector<uint32_t> nearest, closest, reduced, fresh;
+  std::vector<Mean> candidates;
+  std::vector<uint64_t> weights;
+  std::vector<long double> score;
+};
+
+// k-means++: every next mean is a pixel drawn with probability proportional
+// to its squared distance to the closest mean chosen so far. K passes over
+// the pixels.
+void kmeans_plus_plus(const PixelPlanes &dataset, const size_t N,
+                      const uint32_t K, std::mt19937 &eng,
+                      std::vector<Mean> &means, SeedingBuffers &buffers) {
+  auto &closest = buffers.closest;
+  closest.assign(N, std::numeric_limits<uint32_t>::max());
+  means[0] = dataset[std::uniform_int_distribution<size_t>(0, N - 1)(eng)];
+
+  for (uint32_t k = 1; k < K; ++k) {
+    for (size_t i = 0; i < N; ++i) {
+      closest[i] = std::min<uint32_t>(
+          closest[i], SquaredEuclidean::distance(dataset[i], means[k - 1]));
+    }
+    means[k] = dataset[sample_weighted(closest, eng)];
+  }
+}
+
+// k-means|| (scalable k-means++): a few oversampling rounds each pick about
+// 2K candidates at once, so only KMEANS_PARALLEL_ROUNDS + 1 passes touch every
+// pixel, each one assigning them to that round's new candidates alone through
+// the SIMD assignment kernel and keeping the closer of the two. The
+// candidates, weighted by the pixels closest to them, are then reduced to K
+// means with k-means++.
+constexpr uint32_t KMEANS_PARALLEL_ROUNDS = 5;
+
+void kmeans_parallel(const PixelPlanes &dataset, const size_t N,
+                     const uint32_t K, std::mt19937 &eng,
+                     std::vector<Mean> &means, SeedingBuffers &buffers) {
+  const double oversampling = 2.0 * K;
+  std::uniform_real_distribution<double> coin(0.0, 1.0);
+  auto &nearest = buffers.nearest;
+  auto &closest = buffers.closest;
+  auto &fresh = buffers.fresh;
+  auto &candidates = buffers.candidates;
+  nearest.assign(N, 0);
+  closest.assign(N, std::numeric_limits<uint32_t>::max());
+  fresh.resize(N);
+  candidates.assign(
+      1, dataset[std::uniform_int_distribution<size_t>(0, N - 1)(eng)]);
+
+  size_t first = 0;
+  for (uint32_t round = 0; round <= KMEANS_PARALLEL_ROUNDS; ++round) {
+    const size_t count = candidates.size() - first;
+    assign_engine<SquaredEuclidean, int32_t, uint32_t>().for_k(count)(
+        dataset, 0, N, &candidates[first], count, fresh.data());
+
+    // Ties keep the earlier candidate, as a pass over all of them would.
+    uint64_t cost = 0;
+    for (size_t i = 0; i < N; ++i) {
+      const uint32_t c = first + fresh[i];
+      const uint32_t distance =
+          SquaredEuclidean::distance(dataset[i], candidates[c]);
+      if (distance < closest[i]) {
+        closest[i] = distance;
+        nearest[i] = c;
+      }
+      cost += closest[i];
+    }
+
+    if (round == KMEANS_PARALLEL_ROUNDS || cost == 0) {
+      break;
+    }
+
+    // Pixels on a candidate cannot be drawn, so they skip the coin.
+    first = candidates.size();
+    for (size_t i = 0; i < N; ++i) {
+      if (closest[i] &&
+          coin(eng) < oversampling * closest[i] / static_cast<double>(cost)) {
+        candidates.push_back(dataset[i]);
+      }
+    }
+  }
+
+  auto &weights = buffers.weights;
+  weights.assign(candidates.size(), 0);
+  for (size_t i = 0; i < N; ++i) {
+    ++weights[nearest[i]];
+  }
+
+  auto &score = buffers.score;
+  auto &reduced = buffers.reduced;
+  score.resize(candidates.size());
+  reduced.assign(candidates.size(), std::numeric_limits<uint32_t>::max());
+  means[0] = candidates[sample_weighted(weights, eng)];
+  for (uint32_t k = 1; k < K; ++k) {
+    for (size_t c = 0; c < candidates.size(); ++c) {
+      reduced[c] = std::min<uint32_t>(
+          reduced[c], SquaredEuclidean::distance(candidates[c], means[k - 1]));
+      score[c] = static_cast<long double>(reduced[c]) * weights[c];
+    }
+    means[k] = candidates[sample_weighted(score, eng)];
+  }
+}
+
+// 64-bit FNV-1a.
+uint64_t fnv1a(const void *data, const size_t size) {
+  const auto *const bytes = static_cast<const uint8_t *>(data);
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// Records the means the next pass will use in visited, the hashes of those
+// of the earlier passes. The classes follow from the means alone, so means
+// seen before replay the passes since then: returns how many passes ago
+// they were used, 1 when the next pass would change no class and more when
+// the classes cycle, or 0 for new means.
+uint32_t revisit(const std::vector<Mean> &means,
+                 std::vector<uint64_t> &visited) {
+  const uint64_t hash = fnv1a(means.data(), means.size() * sizeof(Mean));
+  const auto seen = std::find(visited.begin(), visited.end(), hash);
+  if (seen != visited.end()) {
+    return static_cast<uint32_t>(visited.end() - seen);
+  }
+
+  visited.push_back(hash);
+  return 0;
+}
+
+// Scratch of mini-batch runs: the sampled pixels and their labels, the means
+// before an iteration and the pixels each cluster received.
+struct MiniBatchBuffers {
+  std::unique_ptr<PixelPlanes> batch;
+  LabelStorage classes;
+  std::vector<Mean> previous;
+  std::vector<uint64_t> counts;
+};
+
+// Every buffer of a k-means run: the random engine, means, labels, cluster
+// sums, assignment bounds and thread-private sums, the seeding and mini-batch
+// scratch, the pyramid levels, the changed counts and the hashes of the
+// means of every pass.
+// Buffers are resized, never released, so repeated runs (the repetitions and
+// ks of exp()) stop allocating once they have seen the largest K.
+struct KMeansWorkspace {
+  std::random_device rdev;
+  std::mt19937 eng;
+  std::vector<Mean> means, previous_means;
+  LabelStorage classes, color_classes;
+  ClusterSums sums = ClusterSums(0);
+  AssignmentBuffers assignment;
+  SeedingBuffers seeding;
+  MiniBatchBuffers mini_batch;
+  std::vector<PyramidLevel> levels;
+  std::vector<size_t> changes;
+  std::vector<uint64_t> visited;
+};
+
+// ANALISE QUANTITATIVA DA FUNÇÃO kmeans
+// (4, 0, 1) + K * (4, 1, 1) +
+// (3, 0, 1) + N * ((2, 1, 2)) +
+// (5, 0, 0) + K * ((1, 0, 0)) +
+// (0, 0, 1) + X * (
+//    (2, 2, 2) + (
+//       (1, 0, 1) + N * ((1, 1, 1) + (4, 0, 1) +  (1, 0, 1) + K * (
+//          (1, 1, 1) + (16, 9, 1)
+//      )) +
+//       (1, 0, 1) + K * ((1, 1, 1) + (10, 3, 1) + (1, 0, 1) + N * (
+//          (1, 1, 1) + (7, 4, 1)
+//      ))
+//    )
+// )
+//
+// JUNTA OS TERMOS EM COMUM
+//
+// (12, 0, 3) + K * (5, 1, 1) + N * (2, 1, 2) + X * (
+//    (4, 2, 4) + N * ((6, 1, 3) + K * (17, 10, 2)) +
+//    K * ((12, 4, 3) + N * (8, 5, 2))
+// )
+//
+// (12, 0, 3) + K * (5, 1, 1) + N * (2, 1, 2) + X * (
+//    (4, 2, 4) + N * (6, 1, 3) + (N * K) * (17, 10, 2) +
+//    K * (12, 4, 3) + (N * K) * (8, 5, 2)
+// )
+//
+// (12, 0, 3) + K * (5, 1, 1) + N * (2, 1, 2) + X * (
+//    (4, 2, 4) + N * (6, 1 ,3) + K * (12, 4, 3) + (N * K) * (25, 15, 4)
+// )
+//
+// Separando (A, O, C)
+// A = 12 + 5K + 2N + X (4 + 6N + 12K + 25NK)
+// O = K + N + X (2 + N + 4K + 15NK)
+// C = 3 + K + 2N + X (4 + 3N + 3K + 4NK)
+//
+//  INIT
+// A = 12 + 5K + 2N
+// O = K + N
+// C = 3 + K + 2N
+//
+//  ITERATION
+// A = 4 + 6 + 12K + 25NK
+// O = 2 + N + 4K + 15NK
+// C = 4 + 3N + 3K + 4NK
+//
+// Utilizar a aula 11 (1h01min) para construir a tabela e ter as normas L1 e L2
+//
+// Obs.: a análise acima é da versão original. O passo de atualização agora
+// acumula somas e contagens por cluster em uma única varredura O(N), então o
+// termo (N * K) * (8, 5, 2) foi substituído por um termo linear em N
+
+// Draws the K initial means of a run into workspace.means, as options.init
+// asks.
+void init_means(const PixelPlanes &dataset, const size_t N, const uint32_t K,
+                const KMeansOptions &options, KMeansWorkspace &workspace) {
+  auto &eng = workspace.eng;
+  auto &means = workspace.means;
+  switch (options.init) {
+  case KMeansInit::PlusPlus:
+    kmeans_plus_plus(dataset, N, K, eng, means, workspace.seeding);
+    break;
+  case KMeansInit::Parallel:
+    kmeans_parallel(dataset, N, K, eng, means, workspace.seeding);
+    break;
+  default:
+    std::uniform_int_distribution<size_t> dist(0, N - 1);
+    for (uint32_t k = 0; k < K; ++k) {
+      // g12(1, 0, 1); gr2(1, 1, 1); e2(2, 0, 0)
+      means[k] = dataset[dist(eng)];
+    }
+  }
+}
+
+// With seeded, the iterations start from the means already in workspace
+// instead of a fresh initialization.
+template <typename Assignment>
+KMeansResult kmeans_with(const PixelPlanes &dataset, const size_t N,
+                         const uint32_t K, const KMeansOptions &options,
+                         KMeansWorkspace &workspace,
+                         const bool seeded = false) {
+  using Label = typename Assignment::label;
+  const uint32_t max_iterations = options.max_iterations;
+
+  workspace.eng.seed(options.seed ? options.seed : workspace.rdev());
+
+  const auto init_time_start = std::chrono::high_resolution_clock::now();
+
+  auto &means = workspace.means; // (1, 0, 0)
+  means.resize(K);               // (K + 1, 0, 0)
+  if (!seeded) {
+    init_means(dataset, N, K, options, workspace);
+  }
+
+  auto &classes = std::get<std::vector<Label>>(workspace.classes); // (1, 0, 0)
+  classes.assign(N, std::numeric_limits<Label>::max()); // N * (2, 1, 2)
+
+  // In histogram mode the iterations run over the unique colors, each one
+  // weighted by its pixel count, and the labels are expanded at the end.
+  const ColorHistogram *const histogram =
+      options.histogram ? &dataset.histogram() : nullptr;
+  auto &color_classes = std::get<std::vector<Label>>(workspace.color_classes);
+  if (histogram) {
+    color_classes.assign(histogram->counts.size(),
+                         std::numeric_limits<Label>::max());
+  }
+  const PixelPlanes &points = histogram ? *histogram->colors : dataset;
+  const size_t points_count = histogram ? points.size : N;
+  const uint32_t *const weights =
+      histogram ? histogram->counts.data() : nullptr;
+  auto &point_classes = histogram ? color_classes : classes;
+
+  uint32_t x = 0;              // (1, 0, 0)
+  size_t changed;              // (1, 0, 0)
+  auto &sums = workspace.sums; // (1, 0, 0)
+  sums.resize(K);              // (4K, 0, 0)
+  sums.reset();
+  auto &previous_means = workspace.previous_means;
+  auto &changes = workspace.changes;
+  changes.clear();
+  auto &visited = workspace.visited;
+  visited.clear();
+  revisit(means, visited);
+  Assignment assignment(points_count, K, options, workspace.assignment);
+
+  const auto init_time_end = std::chrono::high_resolution_clock::now();
+
+  const auto iterations_time_start = std::chrono::high_resolution_clock::now();
+  for (; x < max_iterations; ++x) {
+    // g13(0, 0, 1); gr3(1, 1, 1);
+    // ex3 = (1, 1, 1) + (gr4 + ex4) + (gr6 + ex6)
+    if constexpr (Assignment::fuses_sums) {
+      changed = assignment.assign_and_sum(points, points_count, weights, means,
+                                          point_classes.data(), sums, x > 0);
+    } else {
+      changed = assignment.assign(points, points_count, means, point_classes);
+    }
+    changes.push_back(changed);
+
+    if (!changed) { // (0, 1, 1)
+      break;
+    }
+
+    if constexpr (Assignment::tracks_drift) {
+      previous_means = means;
+    }
+
+    if constexpr (!Assignment::fuses_sums) {
+      assignment.update_sums(points, points_count, weights, point_classes,
+                             sums);
+    }
+    sums.means(means);
+
+    if (const uint32_t period = revisit(means, visited)) {
+      ++x;
+      if (period > 1) {
+        std::clog << "clustering finished due to a cycle of " << period
+                  << " iterations\n";
+      }
+      break;
+    }
+
+    assignment.means_moved(previous_means, means, point_classes);
+  }
+
+  if (histogram) {
+    for (size_t i = 0; i < N; ++i) {
+      classes[i] = color_classes[histogram->color_of[i]];
+    }
+  }
+
+  const auto iterations_time_end = std::chrono::high_resolution_clock::now();
+
+  if (x == max_iterations) {
+    std::clog << "clustering finished due to MAX_ITERATIONS reached\n";
+  }
+
+  return {init_time_end - init_time_start,
+          iterations_time_end - iterations_time_start,
+          x,
+          max_iterations,
+          &means,
+          LabelView(classes),
+          &workspace.levels,
+          &workspace.changes,
+          nullptr};
+}
+
+// Coarse-to-fine run: the means are initialized and converged on the
+// coarsest level of the pyramid (at most options.pyramid halvings, each with
+// at least K pixels), then seed every finer level in turn, so that fewer
+// iterations are left at full resolution.
+template <typename Assignment>
+KMeansResult kmeans_pyramid(const PixelPlanes &dataset, const size_t N,
+                            const uint32_t K, const KMeansOptions &options,
+                            KMeansWorkspace &workspace) {
+  auto &levels = workspace.levels;
+  levels.clear();
+
+  uint32_t depth = 0;
+  for (const PixelPlanes *level = &dataset;
+       depth < options.pyramid && level->width >= 2 && level->height >= 2 &&
+       level->half().size >= K;
+       level = &level->half()) {
+    ++depth;
+  }
+
+  duration coarse(0);
+  for (uint32_t l = depth; l > 0; --l) {
+    const PixelPlanes *level = &dataset;
+    for (uint32_t i = 0; i < l; ++i) {
+      level = &level->half();
+    }
+
+    const auto result = kmeans_with<Assignment>(*level, level->size, K, options,
+                                                workspace, l != depth);
+    levels.push_back({level->width, level->height, result.iterations_count,
+                      result.overall()});
+    coarse += result.overall();
+  }
+
+  const auto result =
+      kmeans_with<Assignment>(dataset, N, K, options, workspace, depth > 0);
+
+  return {result.init_in_seconds + coarse,
+          result.iterations_in_seconds,
+          result.iterations_count,
+          result.max_iterations,
+          result.means_ptr,
+          result.labels,
+          result.levels_ptr,
+          result.changes_ptr,
+          nullptr};
+}
+
+// Mini-batch k-means (Sculley, 2010). Every iteration assigns
+// options.mini_batch pixels drawn at random and moves each mean toward its
+// pixels with a learning rate of 1 / (pixels the cluster has received so
+// far), so an iteration costs O(batch * K) instead of O(N * K). The run stops
+// once no mean moves farther than options.tolerance in an iteration. The
+// final pass then labels every pixel with the last means; without it only
+// the means are meaningful. Its time is part of the iterations time.
+template <typename Metric, typename Label>
+KMeansResult kmeans_mini_batch(const PixelPlanes &dataset, const size_t N,
+                               const uint32_t K, const KMeansOptions &options,
+                               KMeansWorkspace &workspace) {
+  const uint32_t max_iterations = options.max_iterations;
+
+  auto &eng = workspace.eng;
+  eng.seed(options.seed ? options.seed : workspace.rdev());
+  std::uniform_int_distribution<size_t> dist(0, N - 1);
+
+  const auto init_time_start = std::chrono::high_resolution_clock::now();
+
+  auto &means = workspace.means;
+  means.resize(K);
+  init_means(dataset, N, K, options, workspace);
+
+  auto &buffers = workspace.mini_batch;
+  const size_t batch_size = std::clamp<size_t>(
+      options.mini_batch, 1, std::numeric_limits<uint32_t>::max());
+  if (!buffers.batch || buffers.batch->size < batch_size) {
+    buffers.batch = std::make_unique<PixelPlanes>(batch_size, 1);
+  }
+  auto &batch = *buffers.batch;
+  auto &batch_classes = std::get<std::vector<Label>>(buffers.classes);
+  batch_classes.resize(batch_size);
+
+  buffers.counts.assign(K, 0);
+
+  auto &classes = std::get<std::vector<Label>>(workspace.classes);
+  classes.assign(N, std::numeric_limits<Label>::max());
+  workspace.levels.clear();
+  workspace.changes.clear();
+  const auto kernel = assign_engine<Metric, Label>(options.precision).for_k(K);
+
+  const auto init_time_end = std::chrono::high_resolution_clock::now();
+
+  const auto iterations_time_start = std::chrono::high_resolution_clock::now();
+  const double tolerance = options.tolerance * options.tolerance;
+  uint32_t x = 0;
+  bool converged = false;
+  while (!converged && x < max_iterations) {
+    ++x;
+
+    for (size_t j = 0; j < batch_size; ++j) {
+      const size_t i = dist(eng);
+      batch.r[j] = dataset.r[i];
+      batch.g[j] = dataset.g[i];
+      batch.b[j] = dataset.b[i];
+    }
+    kernel(batch, 0, batch_size, means.data(), K, batch_classes.data());
+
+    buffers.previous = means;
+    for (size_t j = 0; j < batch_size; ++j) {
+      const size_t k = batch_classes[j];
+      const double rate = 1.0 / ++buffers.counts[k];
+      auto &mean = means[k];
+      mean.r += rate * (batch.r[j] - mean.r);
+      mean.g += rate * (batch.g[j] - mean.g);
+      mean.b += rate * (batch.b[j] - mean.b);
+    }
+
+    converged = true;
+    for (uint32_t k = 0; k < K; ++k) {
+      converged &= SquaredEuclidean::distance<double>(
+                       means[k], buffers.previous[k]) <= tolerance;
+    }
+  }
+
+  if (options.final_pass) {
+    kernel(dataset, 0, N, means.data(), K, classes.data());
+  }
+
+  const auto iterations_time_end = std::chrono::high_resolution_clock::now();
+
+  if (!converged) {
+    std::clog << "clustering finished due to MAX_ITERATIONS reached\n";
+  }
+
+  return {init_time_end - init_time_start,
+          iterations_time_end - iterations_time_start,
+          x,
+          max_iterations,
+          &means,
+          LabelView(classes),
+          &workspace.levels,
+          &workspace.changes,
+          nullptr};
+}
+
+template <typename Metric, typename Label>
+KMeansResult kmeans_in(const PixelPlanes &dataset, const size_t N,
+                       const uint32_t K, const KMeansOptions &options,
+                       KMeansWorkspace &workspace) {
+  if (options.mini_batch) {
+    return kmeans_mini_batch<Metric, Label>(dataset, N, K, options, workspace);
+  }
+
+  switch (options.algorithm) {
+  case KMeansAlgorithm::Elkan:
+    return kmeans_pyramid<ElkanAssignment<Metric, Label>>(dataset, N, K,
+                                                          options, workspace);
+  case KMeansAlgorithm::Hamerly:
+    return kmeans_pyramid<HamerlyAssignment<Metric, Label>>(
+        dataset, N, K, options, workspace);
+  case KMeansAlgorithm::Yinyang:
+    return kmeans_pyramid<YinyangAssignment<Metric, Label>>(
+        dataset, N, K, options, workspace);
+  default:
+    return kmeans_pyramid<LloydAssignment<Metric, Label>>(dataset, N, K,
+                                                          options, workspace);
+  }
+}
+
+// Picks the narrowest label type that holds K classes plus the unassigned
+// value numeric_limits<Label>::max().
+template <typename Metric>
+KMeansResult kmeans_in(const PixelPlanes &dataset, const size_t N,
+                       const uint32_t K, const KMeansOptions &options,
+                       KMeansWorkspace &workspace) {
+  if (K < 1u << 8) {
+    return kmeans_in<Metric, uint8_t>(dataset, N, K, options, workspace);
+  }
+  if (K < 1u << 16) {
+    return kmeans_in<Metric, uint16_t>(dataset, N, K, options, workspace);
+  }
+  return kmeans_in<Metric, uint32_t>(dataset, N, K, options, workspace);
+}
+
+// Online k-means (MacQueen, 1967) over pixels that arrive in chunks, from a
+// decoder, a camera or a mapped file. Every pixel moves its nearest mean
+// toward itself by 1 / (pixels the cluster has received). Pixels arrive in
+// scan order, so the first ones are a poor sample: a pixel farther from
+// every mean than the two closest means are from each other merges that
+// pair (weighted by their counts) and starts a cluster of its own. Only the
+// K means and their counts are kept, and palette() is current after every
+// push().
+template <typename Metric> class OnlineKMeans {
+public:
+  explicit OnlineKMeans(const uint32_t _K) : K(_K) {
+    if (!K) {
+      throw std::domain_error("number of clusters must be above 0");
+    }
+    means.reserve(K);
+    counts.reserve(K);
+  }
+
+  // Interleaved 8-bit RGB, as decoders and cameras hand it out.
+  void push(const uint8_t *const rgb, const size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      const uint8_t *const pixel = rgb + i * IMAGE_CHANNELS;
+      add({pixel[0], pixel[1], pixel[2]});
+    }
+  }
+
+  void push(const PixelPlanes &pixels, const size_t begin, const size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      add(pixels[i]);
+    }
+  }
+
+  // Current means, fewer than K until K distinct colors have arrived.
+  inline const std::vector<Mean> &palette() const { return means; }
+  inline size_t pixels() const { return seen; }
+
+private:
+  // Pixels between two searches for the closest pair of means, which drift
+  // slowly once their clusters have a few pixels.
+  static constexpr size_t PAIR_REFRESH = 1024;
+
+  const uint32_t K;
+  // The exact running means and the pixels of each cluster.
+  std::vector<Mean> means;
+  std::vector<uint64_t> counts;
+  size_t seen = 0;
+  uint32_t pair_a = 0, pair_b = 0;
+  double pair_distance = std::numeric_limits<double>::infinity();
+
+  inline void add(const Pixel &pixel) {
+    const uint32_t filled = means.size();
+    uint32_t nearest = 0;
+    double minimum = std::numeric_limits<double>::infinity();
+    for (uint32_t k = 0; k < filled; ++k) {
+      const double distance =
+          Metric::template distance<double>(pixel, means[k]);
+      if (distance < minimum) {
+        minimum = distance;
+        nearest = k;
+      }
+    }
+
+    if (++seen % PAIR_REFRESH == 0) {
+      find_closest_pair();
+    }
+
+    if (filled < K && minimum != 0) {
+      means.push_back(pixel);
+      counts.push_back(1);
+      find_closest_pair();
+      return;
+    }
+
+    if (filled == K && K > 1 && minimum > pair_distance) {
+      move(pair_a, means[pair_b], counts[pair_b]);
+      means[pair_b] = pixel;
+      counts[pair_b] = 1;
+      find_closest_pair();
+      return;
+    }
+
+    move(nearest, pixel, 1);
+  }
+
+  // Adds `count` pixels centered at `center` to cluster k.
+  inline void move(const uint32_t k, const Mean &center,
+                   const uint64_t count) {
+    counts[k] += count;
+    const double rate = static_cast<double>(count) / counts[k];
+    auto &mean = means[k];
+    mean.r += rate * (center.r - mean.r);
+    mean.g += rate * (center.g - mean.g);
+    mean.b += rate * (center.b - mean.b);
+  }
+
+  void find_closest_pair() {
+    pair_distance = std::numeric_limits<double>::infinity();
+    for (uint32_t a = 0; a < means.size(); ++a) {
+      for (uint32_t b = a + 1; b < means.size(); ++b) {
+        const double distance =
+            Metric::template distance<double>(means[a], means[b]);
+        if (distance < pair_distance) {
+          pair_distance = distance;
+          pair_a = a;
+          pair_b = b;
+        }
+      }
+    }
+  }
+};
+
+// One OnlineKMeans pass over an image, pushed in chunks of options.tile
+// pixels. It assigns no labels; the result holds the palette alive.
+template <typename Metric>
+KMeansResult kmeans_online_in(const PixelPlanes &dataset, const size_t N,
+                              const uint32_t K, const KMeansOptions &options,
+                              KMeansWorkspace &workspace) {
+  const auto iterations_time_start = std::chrono::high_resolution_clock::now();
+
+  auto online = std::make_shared<OnlineKMeans<Metric>>(K);
+  const size_t chunk = std::max<size_t>(options.tile, 1);
+  for (size_t begin = 0; begin < N; begin += chunk) {
+    online->push(dataset, begin, std::min(begin + chunk, N));
+  }
+
+  const auto iterations_time_end = std::chrono::high_resolution_clock::now();
+
+  workspace.levels.clear();
+  workspace.changes.clear();
+  return {duration(0),
+          iterations_time_end - iterations_time_start,
+          1,
+          options.max_iterations,
+          &online->palette(),
+          LabelView(static_cast<const uint8_t *>(nullptr), 0),
+          &workspace.levels,
+          &workspace.changes,
+          std::move(online)};
+}
+
+KMeansResult kmeans_online(const PixelPlanes &dataset, const size_t N,
+                           const uint32_t K, const KMeansOptions &options,
+                           KMeansWorkspace &workspace) {
+  switch (options.metric) {
+  case KMeansMetric::Manhattan:
+    return kmeans_online_in<Manhattan>(dataset, N, K, options, workspace);
+  case KMeansMetric::Chebyshev:
+    return kmeans_online_in<Chebyshev>(dataset, N, K, options, workspace);
+  default:
+    return kmeans_online_in<SquaredEuclidean>(dataset, N, K, options,
+                                              workspace);
+  }
+}
+
+// Runs k-means with the buffers of workspace; the result points into it.
+KMeansResult kmeans(const PixelPlanes &dataset, const size_t N,
+                    const uint32_t K, const KMeansOptions &options,
+                    KMeansWorkspace &workspace) {
+  if (!K) {
+    throw std::domain_error("number of clusters must be above 0");
+  }
+
+  if (options.online) {
+    return kmeans_online(dataset, N, K, options, workspace);
+  }
+
+  switch (options.metric) {
+  case KMeansMetric::Manhattan:
+    return kmeans_in<Manhattan>(dataset, N, K, options, workspace);
+  case KMeansMetric::Chebyshev:
+    return kmeans_in<Chebyshev>(dataset, N, K, options, workspace);
+  default:
+    return kmeans_in<SquaredEuclidean>(dataset, N, K, options, workspace);
+  }
+}
+
+// One-off run with a workspace of its own, kept alive by the result.
+KMeansResult kmeans(const PixelPlanes &dataset, const size_t N,
+                    const uint32_t K, const KMeansOptions &options = {}) {
+  auto workspace = std::make_shared<KMeansWorkspace>();
+  KMeansResult result = kmeans(dataset, N, K, options, *workspace);
+  result.owner = std::move(workspace);
+  return result;
+}
+
+// Pixels whose label differs from the one the double distances give for the
+// same means, i.e. the assignments lost to a lower precision.
+template <typename Metric>
+size_t precision_mismatches_in(const PixelPlanes &dataset,
+                               const KMeansResult &result) {
+  const auto &means = result.means();
+  const auto classes = result.classes();
+  std::vector<uint32_t> reference(dataset.size,
+                                  std::numeric_limits<uint32_t>::max());
+  assign_engine<Metric, double, uint32_t>().for_k(means.size())(
+      dataset, 0, dataset.size, means.data(), means.size(), reference.data());
+
+  size_t mismatches = 0;
+  for (size_t i = 0; i < dataset.size; ++i) {
+    mismatches += reference[i] != classes[i];
+  }
+
+  return mismatches;
+}
+
+size_t precision_mismatches(const PixelPlanes &dataset,
+                            const KMeansResult &result,
+                            const KMeansOptions &options) {
+  switch (options.metric) {
+  case KMeansMetric::Manhattan:
+    return precision_mismatches_in<Manhattan>(dataset, result);
+  case KMeansMetric::Chebyshev:
+    return precision_mismatches_in<Chebyshev>(dataset, result);
+  default:
+    return precision_mismatches_in<SquaredEuclidean>(dataset, result);
+  }
+}
+
+// Header of a pixel cache file, followed by the r, g and b planes exactly as
+// PixelPlanes lays them out, so a mapped file is used in place. The source
+// size and hash tell whether the cache still matches its image.
+struct alignas(PIXEL_ALIGNMENT) PixelCacheHeader {
+  char magic[8];
+  uint32_t width, height, channels;
+  uint64_t source_size, source_hash;
+
+  static constexpr char MAGIC[8] = {'K', 'M', 'P', 'I', 'X', 'E', 'L', '1'};
+
+  inline size_t file_size() const {
+    return sizeof(PixelCacheHeader) +
+           channels * PixelPlanes::plane_bytes(static_cast<size_t>(width) *
+                                               height);
+  }
+};
+
+std::vector<char> read_file(const fs::path &file_location) {
+  std::ifstream file(file_location, std::ios::binary | std::ios::ate);
+  if (!file.is_open()) {
+    throw std::domain_error("file not opened: '" + file_location.string() +
+                            "'");
+  }
+
+  std::vector<char> bytes(file.tellg());
+  file.seekg(0);
+  file.read(bytes.data(), bytes.size());
+  return bytes;
+}
+
+// Moves the interleaved buffer of stbi into planes and frees it. stb_image
+// only decodes to interleaved pixels, so the copy goes from the last pixel
+// back in blocks, shrinking the buffer after each one. Planes and buffer
+// then hold about one image between them (3 bytes per pixel) at any time,
+// where a straight copy keeps both alive in full.
+std::unique_ptr<PixelPlanes> decode_image(uint8_t *rgb_image, const int w,
+                                          const int h,
+                                          const fs::path &file_location) {
+  if (!rgb_image) {
+    throw std::domain_error(std::string("error loading image: ") +
+                            stbi_failure_reason() + " " +
+                            file_location.string());
+  }
+
+  auto result_ptr = std::make_unique<PixelPlanes>(static_cast<uint32_t>(w),
+                                                  static_cast<uint32_t>(h));
+  auto &result = *result_ptr;
+
+  for (size_t end = result.size; end > 0;) {
+    const size_t begin = end > DECODE_BLOCK ? end - DECODE_BLOCK : 0;
+
+    size_t src_index = begin * IMAGE_CHANNELS;
+    for (size_t i = begin; i < end; ++i) {
+      result.r[i] = rgb_image[src_index++];
+      result.g[i] = rgb_image[src_index++];
+      result.b[i] = rgb_image[src_index++];
+    }
+
+    end = begin;
+    if (end > 0) {
+      // stbi allocates with malloc, so realloc may hand the tail back.
+      if (void *const shrunk = std::realloc(rgb_image, end * IMAGE_CHANNELS)) {
+        rgb_image = static_cast<uint8_t *>(shrunk);
+      }
+    }
+  }
+
+  stbi_image_free(rgb_image);
+
+  return result_ptr;
+}
+
+// Maps a cache file and returns its planes, or null when the file is
+// missing, truncated or was written for another source. The mapping is
+// private, so the planes can be written without touching the file.
+std::unique_ptr<PixelPlanes> map_pixel_cache(const fs::path &cache_location,
+                                             const uint64_t source_size,
+                                             const uint64_t source_hash) {
+  const int fd = open(cache_location.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+  struct stat info;
+  const bool sized = fstat(fd, &info) == 0 &&
+                     static_cast<size_t>(info.st_size) >=
+                         sizeof(PixelCacheHeader);
+  void *const mapping =
+      sized ? mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                   fd, 0)
+            : MAP_FAILED;
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return nullptr;
+  }
+
+  const size_t length = info.st_size;
+  const std::shared_ptr<uint8_t[]> file(
+      static_cast<uint8_t *>(mapping),
+      [length](uint8_t *ptr) { munmap(ptr, length); });
+
+  const auto &header = *reinterpret_cast<const PixelCacheHeader *>(mapping);
+  if (std::memcmp(header.magic, PixelCacheHeader::MAGIC, 8) != 0 ||
+      header.channels != IMAGE_CHANNELS ||
+      header.source_size != source_size ||
+      header.source_hash != source_hash || header.file_size() != length) {
+    return nullptr;
+  }
+
+  return std::make_unique<PixelPlanes>(
+      header.width, header.height,
+      std::shared_ptr<uint8_t[]>(file, file.get() + sizeof(PixelCacheHeader)));
+}
+
+// Writes the cache through a temporary file renamed into place, so a
+// concurrent reader never maps a partial file. The temporary file is removed
+// when the write fails.
+void write_pixel_cache(const fs::path &cache_location,
+                       const PixelPlanes &pixels, const uint64_t source_size,
+                       const uint64_t source_hash) {
+  PixelCacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, PixelCacheHeader::MAGIC, 8);
+  header.width = pixels.width;
+  header.height = pixels.height;
+  header.channels = IMAGE_CHANNELS;
+  header.source_size = source_size;
+  header.source_hash = source_hash;
+
+  fs::create_directories(cache_location.parent_path());
+  auto temporary = cache_location;
+  temporary += ".tmp" + std::to_string(getpid());
+  try {
+    {
+      std::ofstream file(temporary, std::ios::binary);
+      file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+      file.write(reinterpret_cast<const char *>(pixels.storage.get()),
+                 header.file_size() - sizeof(header));
+      if (!file) {
+        throw std::domain_error("cache file not written: '" +
+                                temporary.string() + "'");
+      }
+    }
+    fs::rename(temporary, cache_location);
+  } catch (...) {
+    std::error_code ignored;
+    fs::remove(temporary, ignored);
+    throw;
+  }
+}
+
+// Decodes an image, or maps its decoded pixels from `cache` when a cache file
+// written for the same source bytes is there. A missing or stale cache file
+// is (re)written after decoding; the cache is only an optimization, so a
+// failed write is reported on stderr and the decoded pixels are kept.
+std::unique_ptr<PixelPlanes> load_dataset(const fs::path &file_location,
+                                          const fs::path &cache = {}) {
+  int w, h, bpp;
+  if (cache.empty()) {
+    uint8_t *const rgb_image = stbi_load(file_location.string().c_str(), &w,
+                                         &h, &bpp, IMAGE_CHANNELS);
+    return decode_image(rgb_image, w, h, file_location);
+  }
+
+  const auto source = read_file(file_location);
+  const auto source_hash = fnv1a(source.data(), source.size());
+  const auto cache_location =
+      cache / (file_location.filename() += ".pixels");
+
+  if (auto pixels =
+          map_pixel_cache(cache_location, source.size(), source_hash)) {
+    return pixels;
+  }
+
+  uint8_t *const rgb_image = stbi_load_from_memory(
+      reinterpret_cast<const stbi_uc *>(source.data()), source.size(), &w, &h,
+      &bpp, IMAGE_CHANNELS);
+  auto pixels = decode_image(rgb_image, w, h, file_location);
+  try {
+    write_pixel_cache(cache_location, *pixels, source.size(), source_hash);
+  } catch (const std::exception &e) {
+    std::cerr << "warning: pixel cache not written: " << e.what() << '\n';
+  }
+  return pixels;
+}
+
+// Drops the mapped pages that lie entirely before first + bytes, from the one
+// holding first on. Scans go forward, so the rest of that first page was
+// already used. Pages of a shared file mapping come back from the file (or
+// the page cache, with the writes made through it) if touched again.
+void release_pages(const void *const first, const size_t bytes) {
+  const auto page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  const auto begin = reinterpret_cast<uintptr_t>(first) / page * page;
+  const auto end = (reinterpret_cast<uintptr_t>(first) + bytes) / page * page;
+  if (begin < end) {
+    madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+  }
+}
+
+// Image read in tiles straight from a read-only mapping, for streamed runs
+// over images larger than memory: a binary PPM (P6, maxval 255) with
+// interleaved pixels, or a pixel cache file (see PixelCacheHeader) with
+// planes. Pages are dropped as soon as their tile is read.
+class PixelStream {
+public:
+  uint32_t width = 0, height = 0;
+  size_t size = 0;
+
+  explicit PixelStream(const fs::path &file_location) {
+    const int fd = open(file_location.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::domain_error("file not opened: '" + file_location.string() +
+                              "'");
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+      length = info.st_size;
+      mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+      throw std::domain_error("file not mapped: '" + file_location.string() +
+                              "'");
+    }
+    madvise(mapping, length, MADV_SEQUENTIAL);
+
+    const auto *const bytes = static_cast<const uint8_t *>(mapping);
+    if (length >= sizeof(PixelCacheHeader) &&
+        std::memcmp(bytes, PixelCacheHeader::MAGIC, 8) == 0) {
+      const auto &header = *reinterpret_cast<const PixelCacheHeader *>(bytes);
+      if (header.channels != IMAGE_CHANNELS || header.file_size() != length) {
+        throw std::domain_error("truncated pixel cache: '" +
+                                file_location.string() + "'");
+      }
+      width = header.width;
+      height = header.height;
+      size = static_cast<size_t>(width) * height;
+      data = bytes + sizeof(PixelCacheHeader);
+      stride = PixelPlanes::plane_bytes(size);
+    } else if (length > 2 && bytes[0] == 'P' && bytes[1] == '6') {
+      size_t offset = 2;
+      uint64_t fields[3];
+      for (auto &field : fields) {
+        field = pnm_field(bytes, offset);
+      }
+      // A single whitespace byte separates the header from the pixels.
+      ++offset;
+      width = fields[0];
+      height = fields[1];
+      size = static_cast<size_t>(width) * height;
+      if (fields[2] != 255 || !size ||
+          offset + size * IMAGE_CHANNELS > length) {
+        throw std::domain_error("unsupported or truncated PPM: '" +
+                                file_location.string() + "'");
+      }
+      data = bytes + offset;
+    } else {
+      throw std::domain_error("streaming needs a binary PPM or a pixel cache "
+                              "file: '" +
+                              file_location.string() + "'");
+    }
+  }
+
+  PixelStream(const PixelStream &) = delete;
+  PixelStream &operator=(const PixelStream &) = delete;
+
+  ~PixelStream() { munmap(mapping, length); }
+
+  inline Pixel operator[](const size_t i) const {
+    if (stride) {
+      return {data[i], data[stride + i], data[2 * stride + i]};
+    }
+    const uint8_t *const pixel = data + i * IMAGE_CHANNELS;
+    return {pixel[0], pixel[1], pixel[2]};
+  }
+
+  // Copies pixels [begin, end) to the front of tile.
+  void read(const size_t begin, const size_t end, PixelPlanes &tile) const {
+    const size_t count = end - begin;
+    if (stride) {
+      uint8_t *const planes[IMAGE_CHANNELS] = {tile.r, tile.g, tile.b};
+      for (uint32_t c = 0; c < IMAGE_CHANNELS; ++c) {
+        const uint8_t *const plane = data + c * stride + begin;
+        std::memcpy(planes[c], plane, count);
+        release_pages(plane, count);
+      }
+      return;
+    }
+
+    const uint8_t *const pixels = data + begin * IMAGE_CHANNELS;
+    size_t src_index = 0;
+    for (size_t i = 0; i < count; ++i) {
+      tile.r[i] = pixels[src_index++];
+      tile.g[i] = pixels[src_index++];
+      tile.b[i] = pixels[src_index++];
+    }
+    release_pages(pixels, count * IMAGE_CHANNELS);
+  }
+
+private:
+  void *mapping = MAP_FAILED;
+  size_t length = 0;
+  const uint8_t *data = nullptr;
+  // Distance between the planes of a cache file; 0 for interleaved pixels.
+  size_t stride = 0;
+
+  // Next decimal field of a PNM header, skipping whitespace and comments.
+  uint64_t pnm_field(const uint8_t *const bytes, size_t &offset) const {
+    while (offset < length &&
+           (std::isspace(bytes[offset]) || bytes[offset] == '#')) {
+      if (bytes[offset] == '#') {
+        while (offset < length && bytes[offset] != '\n') {
+          ++offset;
+        }
+      } else {
+        ++offset;
+      }
+    }
+
+    uint64_t value = 0;
+    const size_t first = offset;
+    while (offset < length && std::isdigit(bytes[offset]) &&
+           value <= std::numeric_limits<uint32_t>::max()) {
+      value = value * 10 + (bytes[offset++] - '0');
+    }
+    if (offset == first || value > std::numeric_limits<uint32_t>::max()) {
+      throw std::domain_error("invalid PPM header");
+    }
+
+    return value;
+  }
+};
+
+// Header of the label file of a streamed run, followed by one label per pixel
+// in row-major order, `bytes` wide each.
+struct alignas(PIXEL_ALIGNMENT) LabelFileHeader {
+  char magic[8];
+  uint32_t width, height, clusters, bytes;
+
+  static constexpr char MAGIC[8] = {'K', 'M', 'L', 'A', 'B', 'E', 'L', '1'};
+};
+
+// Label file mapped for writing, so a streamed run keeps only the labels of
+// the current tile in memory. The result of the run holds it alive.
+class LabelFile {
+public:
+  LabelFile(const fs::path &file_location, const uint32_t width,
+            const uint32_t height, const uint32_t K, const uint32_t bytes)
+      : length(sizeof(LabelFileHeader) +
+               static_cast<size_t>(width) * height * bytes) {
+    if (file_location.has_parent_path()) {
+      fs::create_directories(file_location.parent_path());
+    }
+    const int fd = open(file_location.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd >= 0 && ftruncate(fd, length) == 0) {
+      mapping =
+          mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (mapping == MAP_FAILED) {
+      throw std::domain_error("label file not mapped: '" +
+                              file_location.string() + "'");
+    }
+
+    auto &header = *static_cast<LabelFileHeader *>(mapping);
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, LabelFileHeader::MAGIC, 8);
+    header.width = width;
+    header.height = height;
+    header.clusters = K;
+    header.bytes = bytes;
+  }
+
+  LabelFile(const LabelFile &) = delete;
+  LabelFile &operator=(const LabelFile &) = delete;
+
+  ~LabelFile() { munmap(mapping, length); }
+
+  template <typename Label> inline Label *labels() const {
+    return reinterpret_cast<Label *>(static_cast<uint8_t *>(mapping) +
+                                     sizeof(LabelFileHeader));
+  }
+
+private:
+  const size_t length;
+  void *mapping = MAP_FAILED;
+};
+
+// Lloyd's algorithm over a PixelStream. Every iteration is one sequential
+// scan in tiles of options.tile pixels, each assigned and summed by the Lloyd
+// policy, with the labels written straight to a mapped LabelFile. Memory is
+// bounded by the tile and K, not by the image.
+template <typename Metric, typename Label>
+KMeansResult kmeans_stream_in(const PixelStream &stream, const uint32_t K,
+                              const KMeansOptions &options,
+                              const fs::path &labels_location,
+                              KMeansWorkspace &workspace) {
+  const size_t N = stream.size;
+  const uint32_t max_iterations = options.max_iterations;
+
+  auto &eng = workspace.eng;
+  eng.seed(options.seed ? options.seed : workspace.rdev());
+  std::uniform_int_distribution<size_t> dist(0, N - 1);
+
+  const auto init_time_start = std::chrono::high_resolution_clock::now();
+
+  auto &means = workspace.means;
+  means.resize(K);
+  for (uint32_t k = 0; k < K; ++k) {
+    means[k] = stream[dist(eng)];
+  }
+
+  workspace.levels.clear();
+  auto labels_file = std::make_shared<LabelFile>(
+      labels_location, stream.width, stream.height, K, sizeof(Label));
+  Label *const classes = labels_file->labels<Label>();
+
+  const size_t tile_size = std::clamp<size_t>(
+      options.tile, 1,
+      std::min<size_t>(N, std::numeric_limits<uint32_t>::max()));
+  PixelPlanes tile(tile_size, 1);
+  auto &sums = workspace.sums;
+  sums.resize(K);
+  sums.reset();
+  auto &changes = workspace.changes;
+  changes.clear();
+  auto &visited = workspace.visited;
+  visited.clear();
+  revisit(means, visited);
+  LloydAssignment<Metric, Label> assignment(tile_size, K, options,
+                                            workspace.assignment);
+
+  const auto init_time_end = std::chrono::high_resolution_clock::now();
+
+  const auto iterations_time_start = std::chrono::high_resolution_clock::now();
+  uint32_t x = 0;
+  for (; x < max_iterations; ++x) {
+    // The label file holds nothing of this run before the first pass, so
+    // that pass is summed in full and counted as changed.
+    size_t changed = 0;
+    for (size_t begin = 0; begin < N; begin += tile_size) {
+      const size_t end = std::min(begin + tile_size, N);
+      stream.read(begin, end, tile);
+      changed += assignment.assign_and_sum(tile, end - begin, nullptr, means,
+                                           classes + begin, sums, x > 0);
+      release_pages(classes + begin, (end - begin) * sizeof(Label));
+    }
+    if (x == 0) {
+      changed = N;
+    }
+    changes.push_back(changed);
+
+    if (!changed) {
+      break;
+    }
+
+    sums.means(means);
+
+    if (const uint32_t period = revisit(means, visited)) {
+      ++x;
+      if (period > 1) {
+        std::clog << "clustering finished due to a cycle of " << period
+                  << " iterations\n";
+      }
+      break;
+    }
+  }
+
+  const auto iterations_time_end = std::chrono::high_resolution_clock::now();
+
+  if (x == max_iterations) {
+    std::clog << "clustering finished due to MAX_ITERATIONS reached\n";
+  }
+
+  return {init_time_end - init_time_start,
+          iterations_time_end - iterations_time_start,
+          x,
+          max_iterations,
+          &means,
+          LabelView(classes, N),
+          &workspace.levels,
+          &workspace.changes,
+          std::move(labels_file)};
+}
+
+template <typename Metric>
+KMeansResult kmeans_stream_in(const PixelStream &stream, const uint32_t K,
+                              const KMeansOptions &options,
+                              const fs::path &labels_location,
+                              KMeansWorkspace &workspace) {
+  if (K < 1u << 8) {
+    return kmeans_stream_in<Metric, uint8_t>(stream, K, options,
+                                             labels_location, workspace);
+  }
+  if (K < 1u << 16) {
+    return kmeans_stream_in<Metric, uint16_t>(stream, K, options,
+                                              labels_location, workspace);
+  }
+  return kmeans_stream_in<Metric, uint32_t>(stream, K, options,
+                                            labels_location, workspace);
+}
+
+// Streamed run writing its labels to labels_location; the means point into
+// workspace and the labels into the mapped file, held by the result.
+KMeansResult kmeans_stream(const PixelStream &stream, const uint32_t K,
+                           const KMeansOptions &options,
+                           const fs::path &labels_location,
+                           KMeansWorkspace &workspace) {
+  if (!K) {
+    throw std::domain_error("number of clusters must be above 0");
+  }
+
+  switch (options.metric) {
+  case KMeansMetric::Manhattan:
+    return kmeans_stream_in<Manhattan>(stream, K, options, labels_location,
+                                       workspace);
+  case KMeansMetric::Chebyshev:
+    return kmeans_stream_in<Chebyshev>(stream, K, options, labels_location,
+                                       workspace);
+  default:
+    return kmeans_stream_in<SquaredEuclidean>(stream, K, options,
+                                              labels_location, workspace);
+  }
+}
+
+// Decodes the datasets in order on a loader thread while the caller clusters
+// the previous ones. At most `capacity` images are queued or being decoded,
+// so capacity + 1 are alive at once. With capacity 0 next() decodes on the
+// calling thread. A decode error is rethrown by the next() call that would
+// have returned that image.
+class DatasetLoader {
+public:
+  DatasetLoader(const std::vector<Dataset> &_datasets,
+                const KMeansOptions &options)
+      : datasets(_datasets),
+        capacity(options.stream.empty() ? options.prefetch : 0),
+        histogram(options.histogram), pyramid(options.pyramid),
+        cache(options.cache) {
+    if (capacity) {
+      loader = std::thread(&DatasetLoader::load, this);
+    }
+  }
+
+  ~DatasetLoader() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    space.notify_one();
+    if (loader.joinable()) {
+      loader.join();
+    }
+  }
+
+  std::unique_ptr<PixelPlanes> next() {
+    if (!capacity) {
+      return decode(datasets[consumed++]);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    ready.wait(lock, [this] { return !queue.empty(); });
+    auto entry = std::move(queue.front());
+    queue.pop_front();
+    lock.unlock();
+    space.notify_one();
+
+    if (entry.error) {
+      std::rethrow_exception(entry.error);
+    }
+    return std::move(entry.pixels);
+  }
+
+private:
+  struct Entry {
+    std::unique_ptr<PixelPlanes> pixels;
+    std::exception_ptr error;
+  };
+
+  const std::vector<Dataset> &datasets;
+  const uint32_t capacity;
+  const bool histogram;
+  const uint32_t pyramid;
+  const fs::path cache;
+  size_t consumed = 0;
+  std::thread loader;
+  std::mutex mutex;
+  std::condition_variable ready, space;
+  std::deque<Entry> queue;
+  size_t decoding = 0;
+  bool stopping = false;
+
+  // The pyramid levels and color histograms are built here too when the
+  // runs will use them, so their cost is hidden along with the decode.
+  std::unique_ptr<PixelPlanes> decode(const Dataset &dataset) const {
+    auto pixels = load_dataset(dataset.image, cache);
+    const PixelPlanes *level = pixels.get();
+    for (uint32_t l = 0;; ++l) {
+      if (histogram) {
+        level->histogram();
+      }
+      if (l == pyramid || level->width < 2 || level->height < 2) {
+        break;
+      }
+      level = &level->half();
+    }
+    return pixels;
+  }
+
+  void load() {
+    for (const auto &dataset : datasets) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        space.wait(lock, [this] {
+          return stopping || queue.size() + decoding < capacity;
+        });
+        if (stopping) {
+          return;
+        }
+        ++decoding;
+      }
+
+      Entry entry;
+      try {
+        entry.pixels = decode(dataset);
+      } catch (...) {
+        entry.error = std::current_exception();
+      }
+      const bool failed = static_cast<bool>(entry.error);
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        --decoding;
+        queue.push_back(std::move(entry));
+      }
+      ready.notify_one();
+
+      if (failed) {
+        return;
+      }
+    }
+  }
+};
+
+void write_result_csv(std::ofstream &file, const KMeansResult &result,
+                      const uint16_t i,
+                      const std::vector<KMeansOutputType> types) {
+  if (i == 1) {
+    for (size_t j = 0; j < types.size(); j++) {
+      if (j != 0)
+        file << ',';
+      file << output_type_to_string(types[j]);
+    }
+    file << '\n';
+  }
+
+  for (size_t j = 0; j < types.size(); j++) {
+    if (j != 0)
+      file << ',';
+    if (types[j] != KMeansOutputType::IterationCount) {
+      file << result.from_output_type(types[j]).count();
+    } else {
+      file << result.iterations_count;
+    }
+  }
+  file << '\n';
+}
+
+void write_result_csv(std::ofstream &file, const KMeansResultMean &result_mean,
                       const std::vector<KMeansOutputType> types) {
   file << '\n';
   for (size_t i = 0; i < types.size(); i++) {
@@ -346,13 +3719,145 @@ void write_result_csv(std::ofstream &file, const KMeansResultMean &result_mean,
   }
 }
 
+// Writes the log of repetition `count` of an exp() run: its pyramid levels,
+// changed classes per pass, timings and means, and the labels a lower
+// precision changed when the pixels are at hand.
+void report_run(std::ostream &log, const KMeansResult &result,
+                const uint32_t count, const size_t n, const uint32_t k,
+                const PixelPlanes *const pixels, const KMeansOptions &options) {
+  log << "kmeans begin (" << count << ")\n";
+
+  // The online palette has fewer than K means when the image has fewer than
+  // K distinct colors.
+  assert(options.online ? result.means().size() <= k
+                        : k == result.means().size());
+  assert(options.online || n == result.classes().size());
+
+  for (const auto &level : result.levels()) {
+    log << "pyramid level " << level.width << 'x' << level.height << ": "
+        << level.iterations_count << " iterations, " << level.seconds.count()
+        << "s\n";
+  }
+
+  if (!result.changes().empty()) {
+    log << "changed per iteration:";
+    for (const auto changed : result.changes()) {
+      log << ' ' << changed;
+    }
+    log << '\n';
+  }
+
+  log << "clusters: " << result.means().size() << '\n'
+      << "iterations count: " << result.iterations_count << '\n'
+      << "init time: " << result.init_in_seconds.count() << "s\n"
+      << "overall iterations time: " << result.iterations_in_seconds.count()
+      << "s\n"
+      << "iteration mean time: " << result.iteration().count() << "s\n"
+      << "means colors: ";
+  for (const auto &mean : result.means()) {
+    log << "(" << mean.r << ", " << mean.g << ", " << mean.b << ") ";
+  }
+
+  log << '\n';
+
+  // Online runs and mini-batch runs without a final pass leave the labels
+  // unset.
+  const bool labeled =
+      (options.final_pass || !options.mini_batch) && !options.online;
+  if (options.precision != KMeansPrecision::Float64 && pixels && labeled) {
+    const auto mismatches = precision_mismatches(*pixels, result, options);
+    log << "labels differing from float64: " << mismatches
+        << (mismatches ? " (precision changed the assignment)" : "") << '\n';
+  }
+}
+
+// Rejects the option combinations kmeans() and kmeans_stream() do not
+// support, once and before any output file is opened.
+void check_options(const KMeansOptions &options) {
+  if ((options.mini_batch || options.online) &&
+      (options.algorithm != KMeansAlgorithm::Lloyd || options.histogram ||
+       options.pyramid || (options.mini_batch && options.online))) {
+    throw std::domain_error("--mini-batch and --online cannot be combined "
+                            "with each other, --algorithm, --histogram or "
+                            "--pyramid");
+  }
+
+  if (resolve_threads(options.jobs) > 1 &&
+      resolve_threads(options.threads) > 1) {
+    throw std::domain_error("--jobs and --threads cannot both be above 1");
+  }
+
+  if (options.stream.empty()) {
+    return;
+  }
+
+  if (options.algorithm != KMeansAlgorithm::Lloyd ||
+      options.init != KMeansInit::Random || options.histogram ||
+      options.pyramid || options.mini_batch || options.online) {
+    throw std::domain_error("streaming supports only --algorithm=lloyd and "
+                            "--init=random, without --histogram, --pyramid, "
+                            "--mini-batch or --online");
+  }
+
+  // Streamed runs map their images themselves and write one label file per
+  // (image, k), so their repetitions cannot run side by side.
+  if (resolve_threads(options.jobs) > 1) {
+    throw std::domain_error("--stream cannot be combined with --jobs above 1");
+  }
+}
+
 int exp(const std::vector<Dataset> &datasets,
-        const std::vector<KMeansOutputType> &outputTypes) {
+        const std::vector<KMeansOutputType> &outputTypes,
+        const KMeansOptions &options) {
+  check_options(options);
+
+  std::clog << "assign kernel: "
+            << assign_engine<SquaredEuclidean, int32_t, uint8_t>().name
+            << '\n'
+            << "algorithm: " << algorithm_to_string(options.algorithm)
+            << (options.histogram ? " (color histogram)" : "") << '\n'
+            << "metric: " << metric_to_string(options.metric) << '\n'
+            << "precision: " << precision_to_string(options.precision) << '\n'
+            << "init: " << init_to_string(options.init) << '\n'
+            << "pyramid levels: " << options.pyramid << '\n'
+            << "threads: " << resolve_threads(options.threads) << '\n'
+            << "jobs: " << resolve_threads(options.jobs) << '\n'
+            << "prefetch: " << options.prefetch << '\n'
+            << "stream: "
+            << (options.stream.empty() ? "off" : options.stream.string())
+            << '\n'
+            << "cache: "
+            << (options.cache.empty() ? "off" : options.cache.string())
+            << '\n';
+
+  const bool streaming = !options.stream.empty();
+
+  // The workers pull the repetitions of a k from one counter, each worker
+  // with a workspace of its own reused by all of its runs, so a long run
+  // never leaves the others idle. A run's report is written by its worker
+  // while the workspace still holds its means and labels; the reports, the
+  // CSV rows and the mean are written in repetition order once all of them
+  // are done, as in a sequential sweep.
+  const uint32_t jobs = resolve_threads(options.jobs);
+  ThreadPool pool(jobs);
+  std::vector<std::unique_ptr<KMeansWorkspace>> workspaces(jobs);
+  for (auto &workspace : workspaces) {
+    workspace = std::make_unique<KMeansWorkspace>();
+  }
+  // Results are emplaced in place, so a run after warm-up still allocates
+  // nothing; only their timings are read once the workspace has moved on.
+  std::vector<std::optional<KMeansResult>> results;
+  std::vector<std::string> reports;
+
+  // The next images are decoded while the current one is clustered.
+  DatasetLoader loader(datasets, options);
 
   for (const auto &dataset : datasets) {
 
-    const auto pixels_ptr = load_dataset(dataset.image);
-    const auto n = pixels_ptr->size();
+    const auto pixels_ptr = streaming ? nullptr : loader.next();
+    const auto stream_ptr =
+        streaming ? std::make_unique<PixelStream>(dataset.image) : nullptr;
+    const size_t n = streaming ? stream_ptr->size : pixels_ptr->size;
 
     std::clog << "image: " << dataset.image << '\n'
               << "pixels count: " << n << '\n'
@@ -361,6 +3866,10 @@ int exp(const std::vector<Dataset> &datasets,
     for (const auto k : dataset.ks) {
       const auto filepath = "output" / fs::path("result_") +=
           fs::path(dataset.image).stem() += "_" + std::to_string(k) += ".csv";
+      // Label file of a streamed run, rewritten by every repetition.
+      const auto labels_location =
+          options.stream / (fs::path(dataset.image).stem() +=
+                            "_" + std::to_string(k) + ".labels");
       KMeansResultMean result_mean(dataset.repeat);
 
       std::ofstream file(filepath, std::fstream::out);
@@ -369,41 +3878,49 @@ int exp(const std::vector<Dataset> &datasets,
                                 filepath.string() + "'");
       }
 
-      for (uint32_t count = 1;
-           count < static_cast<uint32_t>(dataset.repeat) + 1; ++count) {
-        if (n < k) {
-          throw std::domain_error("number of clusters must be less than " +
-                                  std::to_string(n));
+      if (!k) {
+        throw std::domain_error("number of clusters must be above 0");
+      }
+      if (n < k) {
+        throw std::domain_error("number of clusters must be less than " +
+                                std::to_string(n));
+      }
+
+      const auto repeat = static_cast<uint32_t>(dataset.repeat);
+      results.resize(std::max<size_t>(results.size(), repeat));
+      reports.resize(results.size());
+      std::atomic<uint32_t> next{0};
+
+      pool.run([&](const uint32_t t) {
+        for (uint32_t r; (r = next++) < repeat;) {
+          // A fixed seed still gives every repetition its own
+          // initialization.
+          KMeansOptions run_options = options;
+          if (options.seed) {
+            run_options.seed = options.seed + r;
+          }
+
+          const auto &result = results[r].emplace(
+              streaming ? kmeans_stream(*stream_ptr, k, run_options,
+                                        labels_location, *workspaces[t])
+                        : kmeans(*pixels_ptr, n, k, run_options,
+                                 *workspaces[t]));
+
+          std::ostringstream report;
+          report_run(report, result, r + 1, n, k,
+                     streaming ? nullptr : pixels_ptr.get(), options);
+          reports[r] = report.str();
         }
+      });
 
+      for (uint32_t r = 0; r < repeat; ++r) {
         if (k > 1) {
           std::clog << '\n';
         }
+        std::clog << reports[r] << std::endl;
 
-        std::clog << "kmeans begin (" << count << ")\n";
-
-        const auto &result = kmeans(*pixels_ptr, n, k);
-
-        assert(k == result.means().size());
-        assert(n == result.classes().size());
-
-        std::clog << "clusters: " << result.means().size() << '\n'
-                  << "iterations count: " << result.iterations_count << '\n'
-                  << "init time: " << result.init_in_seconds.count() << "s\n"
-                  << "overall iterations time: "
-                  << result.iterations_in_seconds.count() << "s\n"
-                  << "iteration mean time: " << result.iteration().count()
-                  << "s\n"
-                  << "means colors: ";
-        for (const auto &mean : result.means()) {
-          std::clog << "(" << mean.r << ", " << mean.g << ", " << mean.b
-                    << ") ";
-        }
-
-        std::clog << '\n' << std::endl;
-
-        write_result_csv(file, result, count, outputTypes);
-        result_mean += result;
+        write_result_csv(file, *results[r], r + 1, outputTypes);
+        result_mean += *results[r];
       }
       write_result_csv(file, result_mean, outputTypes);
     }
@@ -412,14 +3929,73 @@ int exp(const std::vector<Dataset> &datasets,
   return 0;
 }
 
+// Reads a --name=value flag into options.
+void parse_option(KMeansOptions &options, const std::string &arg) {
+  const auto separator = arg.find('=');
+  const auto name = arg.substr(2, separator - 2);
+  const auto value =
+      separator == std::string::npos ? "" : arg.substr(separator + 1);
+
+  if (name == "algorithm") {
+    options.algorithm = algorithm_from_string(value);
+  } else if (name == "init") {
+    options.init = init_from_string(value);
+  } else if (name == "metric") {
+    options.metric = metric_from_string(value);
+  } else if (name == "precision") {
+    options.precision = precision_from_string(value);
+  } else if (name == "pyramid") {
+    options.pyramid = std::stoul(value);
+  } else if (name == "mini-batch") {
+    options.mini_batch = std::stoull(value);
+  } else if (name == "tolerance") {
+    options.tolerance = std::stod(value);
+  } else if (name == "no-final-pass") {
+    options.final_pass = false;
+  } else if (name == "online") {
+    options.online = true;
+  } else if (name == "histogram") {
+    options.histogram = true;
+  } else if (name == "threads") {
+    options.threads = std::stoul(value);
+  } else if (name == "jobs") {
+    options.jobs = std::stoul(value);
+  } else if (name == "prefetch") {
+    options.prefetch = std::stoul(value);
+  } else if (name == "cache") {
+    options.cache = value;
+  } else if (name == "stream") {
+    options.stream = value;
+  } else if (name == "tile") {
+    options.tile = std::stoull(value);
+  } else if (name == "seed") {
+    options.seed = std::stoull(value);
+  } else {
+    throw std::domain_error("unknown option: '" + arg + "'");
+  }
+}
+
 int main(int argc, char *argv[]) {
   try {
-    if (argc > 3) {
+    KMeansOptions options;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i) {
+      const std::string arg(argv[i]);
+      if (arg.rfind("--", 0) == 0) {
+        parse_option(options, arg);
+      } else {
+        args.push_back(arg);
+      }
+    }
+
+    if (args.size() > 2) {
       const std::vector<Dataset> datasets = {
-          Dataset(fs::path(argv[1]), static_cast<uint32_t>(std::atoi(argv[3])),
-                  {static_cast<uint32_t>(std::atoi(argv[2]))})};
+          Dataset(fs::path(args[0]),
+                  static_cast<uint32_t>(std::stoi(args[2])),
+                  {static_cast<uint32_t>(std::stoi(args[1]))})};
       return exp(datasets,
-                 {KMeansOutputType::Init, KMeansOutputType::Iteration});
+                 {KMeansOutputType::Init, KMeansOutputType::Iteration},
+                 options);
     }
 
     std::vector<Dataset> datasets;
@@ -449,8 +4025,10 @@ int main(int argc, char *argv[]) {
 
     std::clog << "read " << datasets.size() << " photos\n";
 
-    return exp(datasets, {KMeansOutputType::Init, KMeansOutputType::Iteration,
-                          KMeansOutputType::IterationCount});
+    return exp(datasets,
+               {KMeansOutputType::Init, KMeansOutputType::Iteration,
+                KMeansOutputType::IterationCount},
+               options);
   } catch (const std::exception &e) {
     std::cerr << e.what() << std::endl;
 